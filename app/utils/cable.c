@@ -4,24 +4,9 @@
 #include "include/colors.h"
 #include "include/types.h"
 #include "include/keyboard.h"
-#include "include/exec.h"
 
 static editor_state_t editor;
 
-void syscall_write(const char* path, const uint8_t* buffer, uint32_t len) {
-    uint8_t bytecode[1024];
-    int ip = 0;
-    bytecode[ip++] = OPCODE_SYSCALL_WRITE;
-    strcpy((char*)&bytecode[ip], path);
-    ip += strlen(path) + 1;
-    *(uint32_t*)&bytecode[ip] = len;
-    ip += sizeof(uint32_t);
-    memcpy(&bytecode[ip], buffer, len);
-    ip += len;
-    bytecode[ip++] = OPCODE_EXIT;
-    interpret_bdx(bytecode);
-}
-
 void editor_init(const char* filename) {
     editor.cx = 0;
     editor.cy = 0;
@@ -29,22 +14,26 @@ void editor_init(const char* filename) {
     strncpy(editor.filename, filename, sizeof(editor.filename) - 1);
     memset(editor.buffer, 0, sizeof(editor.buffer));
 
-    // Load file content if it exists
-    uint32_t bytes_read;
-    uint8_t file_content[EDITOR_ROWS * EDITOR_COLS];
-    if (bdfs_read_file(filename, file_content, &bytes_read) == 0) {
+    // Load file content if it exists, stopping once the screen is full
+    int fd = bdfs_open(filename, BDFS_O_READ);
+    if (fd >= 0) {
+        uint8_t chunk[128];
         int row = 0;
         int col = 0;
-        for (uint32_t i = 0; i < bytes_read && row < EDITOR_ROWS; i++) {
-            if (file_content[i] == '\n') {
-                row++;
-                col = 0;
-            } else if (col < EDITOR_COLS - 1) {
-                editor.buffer[row][col++] = file_content[i];
+        int bytes_read;
+        while (row < EDITOR_ROWS && (bytes_read = bdfs_read(fd, chunk, sizeof(chunk))) > 0) {
+            for (int i = 0; i < bytes_read && row < EDITOR_ROWS; i++) {
+                if (chunk[i] == '\n') {
+                    row++;
+                    col = 0;
+                } else if (col < EDITOR_COLS - 1) {
+                    editor.buffer[row][col++] = chunk[i];
+                }
             }
         }
+        bdfs_close(fd);
         editor.cx = col;
-        editor.cy = row;
+        editor.cy = row < EDITOR_ROWS ? row : EDITOR_ROWS - 1;
     }
 }
 
@@ -100,21 +89,20 @@ void editor_delete_char() {
 }
 
 void editor_save_file() {
-    uint32_t len = 0;
-    uint8_t save_buffer[EDITOR_ROWS * EDITOR_COLS];
+    int fd = bdfs_open(editor.filename, BDFS_O_WRITE | BDFS_O_CREATE | BDFS_O_TRUNC);
+    if (fd < 0) {
+        return;
+    }
     for (int y = 0; y < EDITOR_ROWS; y++) {
         int row_len = strlen(editor.buffer[y]);
         if (row_len > 0) {
-            memcpy(save_buffer + len, editor.buffer[y], row_len);
-            len += row_len;
+            bdfs_write(fd, editor.buffer[y], row_len);
             if (y < EDITOR_ROWS - 1) {
-                save_buffer[len] = '\n';
-                len++;
+                bdfs_write(fd, "\n", 1);
             }
         }
     }
-
-    syscall_write(editor.filename, save_buffer, len);
+    bdfs_close(fd);
     editor.dirty = 0;
 }
 
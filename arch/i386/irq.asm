@@ -12,6 +12,7 @@ irq%1:
 section .text
 
 extern irq_handler
+extern sched_yield_handler
 
 irq_common_stub:
     pusha
@@ -28,7 +29,8 @@ irq_common_stub:
     push eax
     mov eax, irq_handler
     call eax
-    pop eax
+irq_resume:
+    mov esp, eax         ; Frame to resume, possibly another thread's
     pop gs
     pop fs
     pop es
@@ -38,6 +40,22 @@ irq_common_stub:
     sti
     iret
 
+; Voluntary context switch (sched_yield): saves the same frame as an IRQ
+global sched_yield_stub
+sched_yield_stub:
+    cli
+    push byte 0
+    push byte 48         ; SCHED_YIELD_VECTOR
+    pusha
+    push ds
+    push es
+    push fs
+    push gs
+    mov eax, esp
+    push eax
+    call sched_yield_handler
+    jmp irq_resume
+
 IRQ 0, 32
 IRQ 1, 33
 IRQ 2, 34
@@ -2,6 +2,8 @@
 #include "include/idt.h"
 #include "include/pic.h"
 #include "include/ports.h"
+#include "include/sched.h"
+#include "include/cpu.h"
 
 extern void* irq_routines[16];
 
@@ -18,8 +20,11 @@ void irq_uninstall_handler(int irq) {
     irq_routines[irq] = 0;
 }
 
-void irq_handler(struct regs *r) {
+// Returns the frame irq_common_stub resumes: r itself, or another
+// thread's if the scheduler decided to switch
+struct regs* irq_handler(struct regs *r) {
     void (*handler)(struct regs *r);
+    int prev = cpu_context_enter(CPU_CTX_IRQ(r->int_no - 32));
 
     handler = irq_routines[r->int_no - 32];
     if (handler) {
@@ -27,6 +32,9 @@ void irq_handler(struct regs *r) {
     }
 
     pic_send_eoi(r->int_no - 32);
+    cpu_context_exit(prev);
+    sched_irq_wakeup();
+    return sched_preempt(r);
 }
 
 extern void irq0(), irq1(), irq2(), irq3(), irq4(), irq5(), irq6(), irq7(),
@@ -56,12 +56,18 @@ extern isr_handler
 
 isr_common_stub:
     pusha                ; Push all general-purpose registers
-    mov eax, [esp + 32]  ; Get the interrupt number from the stack
-    mov ebx, [esp + 36]  ; Get the error code from the stack
-    push ebx             ; Push error code as the second argument for the C handler
-    push eax             ; Push interrupt number as the first argument
+    push ds              ; Segment registers complete the regs_t frame
+    push es
+    push fs
+    push gs
+    mov eax, esp
+    push eax             ; regs_t* for the C handler (handlers may resume)
     call isr_handler     ; Call the C interrupt handler
-    add esp, 8           ; Clean up the pushed arguments
+    pop eax
+    pop gs
+    pop fs
+    pop es
+    pop ds
     popa                 ; Pop all general-purpose registers
     add esp, 8           ; Clean up the interrupt number and error code
     sti                  ; Re-enable interrupts
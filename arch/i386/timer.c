@@ -3,17 +3,71 @@
 #include "include/ports.h"
 #include "include/memcore.h"
 #include "include/cpu.h"
+#include "include/sched.h"
+
+#define PIT_HZ          1193182
+#define PIT_MAX_NS      54000000 // Longest one-shot interval the 16-bit counter can hold
+#define PIT_CALIBRATE   11932    // 10ms on channel 2
+#define PIT_CALIBRATE_NS 10000000
 
 unsigned int timer_ticks = 0;
 
-void timer_handler(struct regs *r) {
-    timer_ticks++;
-    cpu_tick();
+// ktime_ns() = (tsc - tsc_base) * tsc_mult >> 24. tsc_mult stays 0 without
+// a TSC; the PIT then runs periodically and time has tick resolution.
+static uint64_t tsc_base = 0;
+static uint32_t tsc_mult = 0;
+static uint32_t tsc_khz = 0;
+
+// Pending deadlines, kept as a binary min-heap on deadline
+typedef struct {
+    uint64_t deadline;
+    void (*fn)(void*);
+    void* arg;
+    int id;
+} timer_event_t;
+
+static timer_event_t events[TIMER_MAX_EVENTS];
+static uint32_t event_count = 0;
+static int next_event_id = 1;
+
+static uint64_t next_tick_ns = TIMER_TICK_NS; // When timer_ticks advances next
+static uint64_t armed_deadline = 0;           // What the PIT is counting down to
+static int tickless = 0;
+
+static int cpu_has_tsc() {
+    uint32_t eax = 1, ebx, ecx, edx;
+    asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    return (edx >> 4) & 1; // CPUID.1:EDX.TSC
 }
 
-void timer_install() {
-    // IRQ0 will be fired at 100Hz
-    unsigned int divisor = 1193182 / 100;
+// Count TSC cycles while PIT channel 2 runs down 10ms
+static uint32_t calibrate_tsc() {
+    outb(0x61, (inb(0x61) & ~0x02) | 0x01); // Gate on, speaker off
+    outb(0x43, 0xB0);                       // Channel 2, lo/hi byte, mode 0
+    outb(0x42, PIT_CALIBRATE & 0xFF);
+    outb(0x42, PIT_CALIBRATE >> 8);
+
+    uint64_t start = rdtsc();
+    while (!(inb(0x61) & 0x20)); // OUT2 goes high at terminal count
+    return (uint32_t)(rdtsc() - start);
+}
+
+uint64_t ktime_ns() {
+    if (tsc_mult == 0) {
+        return (uint64_t)timer_ticks * TIMER_TICK_NS;
+    }
+    uint64_t cycles = rdtsc() - tsc_base;
+    uint32_t lo = (uint32_t)cycles;
+    uint32_t hi = (uint32_t)(cycles >> 32);
+    return (((uint64_t)hi * tsc_mult) << 8) + (((uint64_t)lo * tsc_mult) >> 24);
+}
+
+uint32_t timer_get_tsc_khz() {
+    return tsc_khz;
+}
+
+static void pit_periodic(uint32_t hz) {
+    unsigned int divisor = PIT_HZ / hz;
 
     // Send the command byte
     outb(0x43, 0x36);
@@ -23,7 +77,202 @@ void timer_install() {
     unsigned char h = (unsigned char)((divisor >> 8) & 0xFF);
     outb(0x40, l);
     outb(0x40, h);
+}
+
+// Fire IRQ0 once, at (about) the given time
+static void pit_oneshot(uint64_t deadline) {
+    uint64_t now = ktime_ns();
+    uint32_t count = 1;
+    if (deadline > now) {
+        uint64_t delta = deadline - now;
+        if (delta > PIT_MAX_NS) {
+            delta = PIT_MAX_NS;
+            deadline = now + PIT_MAX_NS;
+        }
+        count = ((uint32_t)delta / 1000 * 4887) >> 12; // us * 1.193182
+        if (count == 0) {
+            count = 1;
+        }
+    }
+    outb(0x43, 0x30); // Channel 0, lo/hi byte, mode 0 (interrupt on terminal count)
+    outb(0x40, count & 0xFF);
+    outb(0x40, count >> 8);
+    armed_deadline = deadline;
+}
+
+// Program the next interrupt: the earliest event, and the next tick unless idle
+static void timer_rearm() {
+    uint64_t deadline = ~0ull;
+    if (event_count > 0) {
+        deadline = events[0].deadline;
+    }
+    if (!tickless && next_tick_ns < deadline) {
+        deadline = next_tick_ns;
+    }
+    pit_oneshot(deadline);
+}
+
+static void heap_swap(uint32_t a, uint32_t b) {
+    timer_event_t tmp = events[a];
+    events[a] = events[b];
+    events[b] = tmp;
+}
+
+static void heap_up(uint32_t i) {
+    while (i > 0 && events[(i - 1) / 2].deadline > events[i].deadline) {
+        heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void heap_down(uint32_t i) {
+    for (;;) {
+        uint32_t smallest = i;
+        uint32_t left = 2 * i + 1;
+        uint32_t right = left + 1;
+        if (left < event_count && events[left].deadline < events[smallest].deadline) {
+            smallest = left;
+        }
+        if (right < event_count && events[right].deadline < events[smallest].deadline) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            return;
+        }
+        heap_swap(i, smallest);
+        i = smallest;
+    }
+}
+
+static void heap_remove(uint32_t i) {
+    events[i] = events[--event_count];
+    if (i < event_count) {
+        heap_down(i);
+        heap_up(i);
+    }
+}
+
+// Catch timer_ticks up with the clock and run every expired event
+static void timer_advance() {
+    uint64_t now = ktime_ns();
+    while (now >= next_tick_ns) {
+        timer_ticks++;
+        cpu_tick();
+        sched_tick();
+        next_tick_ns += TIMER_TICK_NS;
+    }
+    while (event_count > 0 && events[0].deadline <= now) {
+        timer_event_t event = events[0];
+        heap_remove(0);
+        event.fn(event.arg);
+    }
+}
+
+void timer_handler(struct regs *r) {
+    if (tsc_mult == 0) {
+        // Periodic fallback: every interrupt is one tick
+        next_tick_ns = ktime_ns();
+        timer_advance();
+        return;
+    }
+    timer_advance();
+    timer_rearm();
+}
+
+int timer_add(uint64_t deadline_ns, void (*fn)(void*), void* arg) {
+    unsigned int flags = irq_save();
+    if (event_count == TIMER_MAX_EVENTS) {
+        irq_restore(flags);
+        return -1;
+    }
+    int id = next_event_id++;
+    if (next_event_id < 0) {
+        next_event_id = 1;
+    }
+    uint32_t i = event_count++;
+    events[i].deadline = deadline_ns;
+    events[i].fn = fn;
+    events[i].arg = arg;
+    events[i].id = id;
+    heap_up(i);
+
+    if (tsc_mult != 0 && deadline_ns < armed_deadline) {
+        timer_rearm(); // Sooner than anything the PIT is counting down to
+    }
+    irq_restore(flags);
+    return id;
+}
+
+void timer_cancel(int id) {
+    unsigned int flags = irq_save();
+    for (uint32_t i = 0; i < event_count; i++) {
+        if (events[i].id == id) {
+            heap_remove(i);
+            break;
+        }
+    }
+    irq_restore(flags);
+}
+
+void udelay(uint32_t us) {
+    if (tsc_mult == 0) {
+        while (us--) {
+            inb(0x80); // About 1us per ISA bus cycle
+        }
+        return;
+    }
+    uint64_t end = ktime_ns() + (uint64_t)us * 1000;
+    while (ktime_ns() < end) {
+        asm volatile("pause");
+    }
+}
+
+void timer_idle_enter() {
+    if (tsc_mult == 0) {
+        return;
+    }
+    unsigned int flags = irq_save();
+    tickless = 1;
+    timer_rearm();
+    irq_restore(flags);
+}
+
+void timer_idle_exit() {
+    if (tsc_mult == 0) {
+        return;
+    }
+    // Woken by another IRQ: account for the ticks that were skipped
+    unsigned int flags = irq_save();
+    tickless = 0;
+    timer_advance();
+    timer_rearm();
+    irq_restore(flags);
+}
+
+void timer_install() {
+    if (cpu_has_tsc()) {
+        // tsc_mult = (10ms in ns << 24) / cycles, a 64/32 divide. The
+        // quotient only fits in 32 bits if the TSC runs above ~4 MHz.
+        uint32_t cycles = calibrate_tsc();
+        uint64_t scaled = (uint64_t)PIT_CALIBRATE_NS << 24;
+        uint32_t high = (uint32_t)(scaled >> 32);
+        uint32_t low = (uint32_t)scaled;
+        uint32_t rem;
+        if (cycles > high) {
+            asm("divl %4" : "=a"(low), "=d"(rem) : "a"(low), "d"(high), "rm"(cycles));
+            tsc_mult = low;
+            tsc_khz = cycles / 10;
+            tsc_base = rdtsc();
+        }
+    }
 
     // Install the handler
     irq_install_handler(0, timer_handler);
-}
\ No newline at end of file
+
+    if (tsc_mult != 0) {
+        timer_rearm();
+    } else {
+        // IRQ0 will be fired at 100Hz
+        pit_periodic(TIMER_HZ);
+    }
+}
@@ -2,16 +2,18 @@
 start:
 
     ; --- Load Kernel from Disk ---
-    ; Uses BIOS interrupt 0x13 to read from the disk
-    mov ah, 0x02      ; Function 02h: Read Sectors
-    mov al, 128       ; Number of sectors to read (Kernel)
-    mov ch, 0         ; Cylinder number
-    mov cl, 3         ; Starting sector number (1 is bios, 2 is this)
-    mov dh, 0         ; Head number
+    ; Uses the BIOS extended read (INT 13h AH=42h) in chunks of 64 sectors,
+    ; since one CHS read can't cross a 64KB segment
+    mov cx, KERNEL_SECTORS / 64
+load_chunk:
+    mov si, dap       ; Disk address packet
+    mov ah, 0x42      ; Function 42h: Extended Read Sectors
     mov dl, 0x80      ; Drive number
-    mov bx, 0x8000    ; Destination buffer
     int 0x13          ; Call BIOS disk services
     jc halt           ; If carry flag is set, halt
+    add word [dap_segment], 64 * 512 / 16 ; Next 32KB of the buffer
+    add dword [dap_lba], 64
+    loop load_chunk
 
     ; --- Read E820 Memory Map ---
     xor ebx, ebx      ; Start with EBX = 0
@@ -46,6 +48,17 @@ read_map:
     mov cr0, eax      ; Write back to CR0
     jmp CODE_SEG:init_pm ; Far jump to the 32-bit code segment
 
+; --- Disk Address Packet for the kernel load ---
+dap:
+    db 0x10           ; Packet size
+    db 0              ; Reserved
+    dw 64             ; Sectors per read
+    dw 0x0000         ; Destination offset
+dap_segment:
+    dw 0x0800         ; Destination segment (0x8000)
+dap_lba:
+    dq 2              ; Kernel starts at LBA 2 (after both boot stages)
+
 ; --- Global Descriptor Table (GDT) ---
 gdt_start:
 gdt_null:      dq 0  ; Null descriptor
@@ -72,7 +85,7 @@ init_pm:
     ; The kernel is loaded at 0x8000, but the linker expects it at 0x100000.
     mov esi, 0x8000      ; Source address
     mov edi, 0x100000    ; Destination address
-    mov ecx, 512 * 128   ; Number of bytes to copy (64KB)
+    mov ecx, 512 * KERNEL_SECTORS ; Number of bytes to copy (128KB)
     cld                  ; Clear direction flag (for forward copying)
     rep movsb            ; Repeat move byte string
 
@@ -87,6 +100,8 @@ halt:
 
 
 
+KERNEL_SECTORS equ 256 ; 128KB, a multiple of 64
+
 ; --- GDT Segment Selectors ---
 CODE_SEG equ 0x08
 DATA_SEG equ 0x10
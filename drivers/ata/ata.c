@@ -1,128 +1,487 @@
 #include "../../include/ata.h"
 #include "../../include/ports.h"
 #include "../../include/memcore.h"
+#include "../../include/klog.h"
+#include "../../include/irq.h"
+#include "../../include/cpu.h"
+#include "../../include/paging.h"
+#include "../../include/pci.h"
 
-// 400ns delay
-static void ata_delay() {
-    inb(ATA_STATUS_CMD_PORT);
-    inb(ATA_STATUS_CMD_PORT);
-    inb(ATA_STATUS_CMD_PORT);
-    inb(ATA_STATUS_CMD_PORT);
-}
+// Both legacy channels are probed with IDENTIFY in each position, and each
+// drive found is registered as a block device (hda..hdd). Requests are
+// queued per channel, since the two drives on a channel share its
+// registers, and the two channels run in parallel. Each step of a transfer
+// is driven by the channel's IRQ: the handler moves the next DRQ block (up
+// to `multiple` sectors with READ/WRITE MULTIPLE) and, when a request
+// finishes, starts the next one. Build with -DATA_DEBUG to log every request.
+//
+// Once the PCI scan finds the IDE controller, requests whose buffer can be
+// described by a PRD table go through bus master DMA instead: one IRQ per
+// request and no port I/O per word. Anything else still uses PIO.
+#ifdef ATA_DEBUG
+#define ata_trace(...) klog("ATA", __VA_ARGS__)
+#else
+#define ata_trace(...)
+#endif
+
+typedef struct {
+    uint32_t addr;
+    uint16_t bytes; // 0 means 64KB
+    uint16_t flags;
+} __attribute__((packed)) ata_prd_t;
+
+typedef struct {
+    uint16_t io;
+    uint16_t control;
+    uint16_t bm_base;        // 0 until ata_dma_init()
+    uint8_t  selected;       // Drive index last selected, for IRQ accounting
+    int      flushing;       // The head request's data is out, waiting for CACHE FLUSH
+    blk_request_t* queue_head;
+    blk_request_t* queue_tail;
+    uint32_t queue_len;
+    ata_prd_t* prd;
+} ata_channel_t;
+
+// 512-byte aligned so a table never crosses a 64KB boundary
+static ata_prd_t prd_tables[ATA_CHANNELS][ATA_PRD_MAX] __attribute__((aligned(512)));
+
+static ata_channel_t channels[ATA_CHANNELS] = {
+    { ATA_PRIMARY_IO, ATA_PRIMARY_CONTROL, 0, 0, 0, 0, 0, 0, prd_tables[0] },
+    { ATA_SECONDARY_IO, ATA_SECONDARY_CONTROL, 0, 0, 0, 0, 0, 0, prd_tables[1] },
+};
+static ata_drive_t drives[ATA_DRIVES];
 
-int ata_status() {
-    return inb(ATA_STATUS_CMD_PORT);
+static const char* drive_names[ATA_DRIVES] = { "hda", "hdb", "hdc", "hdd" };
+
+// 400ns delay
+static void ata_delay(ata_channel_t* ch) {
+    inb(ch->control);
+    inb(ch->control);
+    inb(ch->control);
+    inb(ch->control);
 }
 
 // Poll for status, wait for BSY to clear.
 // Returns status byte.
-static uint8_t ata_poll() {
-    while(inb(ATA_STATUS_CMD_PORT) & ATA_SR_BSY);
-    return inb(ATA_STATUS_CMD_PORT);
+static uint8_t ata_poll(ata_channel_t* ch) {
+    while(inb(ch->io + ATA_REG_STATUS_CMD) & ATA_SR_BSY);
+    return inb(ch->io + ATA_REG_STATUS_CMD);
 }
 
-void ata_init() {
-    // Select the master drive on the primary bus
-    outb(ATA_DRIVE_HEAD_PORT, 0xE0);
-    ata_delay();
+// Sectors moved by the next DRQ block of req
+static uint32_t block_sectors(ata_drive_t* drive, blk_request_t* req) {
+    uint32_t left = req->count - req->transferred;
+    return left < drive->multiple ? left : drive->multiple;
+}
 
-    // Check if the drive is present
-    if (ata_status() == 0xFF) {
-        kprintf("ATA: No drive found\n");
-        return;
+static void transfer_in(ata_channel_t* ch, ata_drive_t* drive, blk_request_t* req) {
+    uint32_t sectors = block_sectors(drive, req);
+    insw(ch->io + ATA_REG_DATA, req->buffer + req->transferred * 512, sectors * 256);
+    req->transferred += sectors;
+}
+
+// Write the next block; it is counted once the drive acknowledges it
+static void transfer_out(ata_channel_t* ch, ata_drive_t* drive, blk_request_t* req) {
+    outsw(ch->io + ATA_REG_DATA, req->buffer + req->transferred * 512, block_sectors(drive, req) * 256);
+}
+
+// Describe req's buffer with PRD entries, one per physically contiguous
+// run that stays inside a 64KB region. Returns -1 if it can't be done.
+static int build_prd(ata_prd_t* prd, blk_request_t* req) {
+    uint32_t virt = (uint32_t)req->buffer;
+    uint32_t left = req->count * 512;
+    uint32_t n = 0;
+    if (virt & 1) {
+        return -1; // The bus master moves 16-bit words
+    }
+
+    while (left > 0) {
+        uint32_t phys = get_phys_addr(virt);
+        if (phys == 0) {
+            return -1;
+        }
+        uint32_t chunk = 0x1000 - (virt & 0xFFF);
+        if (chunk > left) {
+            chunk = left;
+        }
+
+        ata_prd_t* last = n > 0 ? &prd[n - 1] : 0;
+        uint32_t last_len = last ? (last->bytes ? last->bytes : 0x10000) : 0;
+        if (last && last->addr + last_len == phys && (last->addr >> 16) == ((phys + chunk - 1) >> 16)) {
+            last->bytes = (uint16_t)(last_len + chunk); // Wraps to 0 at exactly 64KB
+        } else {
+            if (n == ATA_PRD_MAX) {
+                return -1;
+            }
+            prd[n].addr = phys;
+            prd[n].bytes = (uint16_t)chunk;
+            prd[n].flags = 0;
+            n++;
+        }
+        virt += chunk;
+        left -= chunk;
+    }
+    prd[n - 1].flags = ATA_PRD_EOT;
+    return 0;
+}
+
+static void ata_start(ata_channel_t* ch, blk_request_t* req);
+
+// Retire the head request and start the next one
+static void ata_complete(ata_channel_t* ch, blk_request_t* req, int result) {
+    ata_drive_t* drive = req->dev->driver_data;
+    ch->queue_head = req->next;
+    if (ch->queue_head == 0) {
+        ch->queue_tail = 0;
     }
+    ch->queue_len--;
+    ch->flushing = 0;
 
-    kprintf("ATA: Drive found, waiting for ready...\n");
-    ata_poll();
-    kprintf("ATA: Drive ready\n");
+    if (result != BLK_REQ_DONE) {
+        drive->stats.errors++;
+        ata_trace("%s: %s error at LBA %u", req->dev->name, req->write ? "write" : "read", req->lba);
+    } else if (req->count == 0) {
+        // Pure barrier
+    } else if (req->write) {
+        drive->stats.writes++;
+        drive->stats.sectors_written += req->count;
+    } else {
+        drive->stats.reads++;
+        drive->stats.sectors_read += req->count;
+    }
+
+    req->status = result;
+    if (req->done) {
+        req->done(req);
+    }
+    if (ch->queue_head) {
+        ata_start(ch, ch->queue_head);
+    }
+}
+
+static void start_flush(ata_channel_t* ch, ata_drive_t* drive) {
+    ch->flushing = 1;
+    drive->stats.flushes++;
+    outb(ch->io + ATA_REG_STATUS_CMD, drive->lba48 ? ATA_CMD_CACHE_FLUSH_EXT : ATA_CMD_CACHE_FLUSH);
 }
 
-int ata_read_sector(uint32_t lba, void* buffer) {
-    uint8_t status;
+static uint8_t pick_command(ata_drive_t* drive, blk_request_t* req, int ext) {
+    if (req->dma) {
+        if (req->write) {
+            return ext ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_WRITE_DMA;
+        }
+        return ext ? ATA_CMD_READ_DMA_EXT : ATA_CMD_READ_DMA;
+    }
+    if (req->write) {
+        if (drive->multiple > 1) {
+            return ext ? ATA_CMD_WRITE_MULTIPLE_EXT : ATA_CMD_WRITE_MULTIPLE;
+        }
+        return ext ? ATA_CMD_WRITE_SECTORS_EXT : ATA_CMD_WRITE_SECTORS;
+    }
+    if (drive->multiple > 1) {
+        return ext ? ATA_CMD_READ_MULTIPLE_EXT : ATA_CMD_READ_MULTIPLE;
+    }
+    return ext ? ATA_CMD_READ_SECTORS_EXT : ATA_CMD_READ_SECTORS;
+}
+
+static void ata_start(ata_channel_t* ch, blk_request_t* req) {
+    ata_drive_t* drive = req->dev->driver_data;
+    ata_trace("%s: %s %u sectors at LBA %u", req->dev->name, req->write ? "write" : "read",
+              req->count, req->lba);
 
-    // Wait for drive to be ready to accept commands
-    status = ata_poll();
+    // Select the drive first; DRDY is only meaningful for the selected one
+    uint8_t select = drive->slave ? 0x10 : 0x00;
+    if (ch->selected != (uint8_t)(drive - drives)) {
+        outb(ch->io + ATA_REG_DRIVE_HEAD, 0xE0 | select);
+        ata_delay(ch);
+        ch->selected = (uint8_t)(drive - drives);
+    }
+    uint8_t status = ata_poll(ch);
     if ((status & ATA_SR_DRDY) == 0) {
-        kprintf("ATA: Drive not ready for read command\n");
-        return -1;
+        ata_complete(ch, req, BLK_REQ_ERROR);
+        return;
     }
 
-    // Send the command to read sectors
-    outb(ATA_DRIVE_HEAD_PORT, 0xE0 | ((lba >> 24) & 0x0F));
-    outb(ATA_ERROR_PORT, 0x00);
-    outb(ATA_SECTOR_COUNT_PORT, 1);
-    outb(ATA_LBA_LOW_PORT, (uint8_t)lba);
-    outb(ATA_LBA_MID_PORT, (uint8_t)(lba >> 8));
-    outb(ATA_LBA_HIGH_PORT, (uint8_t)(lba >> 16));
-    outb(ATA_STATUS_CMD_PORT, ATA_CMD_READ_SECTORS);
+    outb(ch->control, 0x00); // nIEN clear: completion raises the IRQ
+    if (req->count == 0) {
+        start_flush(ch, drive);
+        return;
+    }
 
-    // Wait for data to be ready
-    status = ata_poll();
+    req->dma = 0;
+    if (ch->bm_base && drive->dma) {
+        if (build_prd(ch->prd, req) == 0) {
+            req->dma = 1;
+            drive->stats.dma_requests++;
+            outb(ch->bm_base + ATA_BM_COMMAND, 0);
+            outl(ch->bm_base + ATA_BM_PRDT, get_phys_addr((uint32_t)ch->prd));
+            outb(ch->bm_base + ATA_BM_COMMAND, req->write ? 0 : ATA_BM_CMD_READ);
+            // Status bits are write-1-to-clear
+            outb(ch->bm_base + ATA_BM_STATUS,
+                 inb(ch->bm_base + ATA_BM_STATUS) | ATA_BM_SR_ERR | ATA_BM_SR_IRQ);
+        } else {
+            drive->stats.pio_fallbacks++;
+        }
+    }
 
-    // Check for errors
-    if (status & ATA_SR_ERR) {
-        kprintf("ATA: Read error\n");
-        return -1;
+    // LBA48 only where LBA28 can't reach; it takes twice the register writes
+    int ext = req->lba + req->count > ATA_LBA28_LIMIT;
+    if (ext) {
+        outb(ch->io + ATA_REG_DRIVE_HEAD, 0x40 | select);
+        // High-order bytes first, the registers are two-deep FIFOs
+        outb(ch->io + ATA_REG_SECTOR_COUNT, (uint8_t)(req->count >> 8));
+        outb(ch->io + ATA_REG_LBA_LOW, (uint8_t)(req->lba >> 24));
+        outb(ch->io + ATA_REG_LBA_MID, 0);
+        outb(ch->io + ATA_REG_LBA_HIGH, 0);
+    } else {
+        outb(ch->io + ATA_REG_DRIVE_HEAD, 0xE0 | select | ((req->lba >> 24) & 0x0F));
+        outb(ch->io + ATA_REG_ERROR, 0x00);
     }
+    outb(ch->io + ATA_REG_SECTOR_COUNT, (uint8_t)req->count); // 256 is sent as 0
+    outb(ch->io + ATA_REG_LBA_LOW, (uint8_t)req->lba);
+    outb(ch->io + ATA_REG_LBA_MID, (uint8_t)(req->lba >> 8));
+    outb(ch->io + ATA_REG_LBA_HIGH, (uint8_t)(req->lba >> 16));
+    outb(ch->io + ATA_REG_STATUS_CMD, pick_command(drive, req, ext));
 
-    if (!(status & ATA_SR_DRQ)) {
-        kprintf("ATA: DRQ not set after read\n");
-        return -1;
+    if (req->dma) {
+        outb(ch->bm_base + ATA_BM_COMMAND, (req->write ? 0 : ATA_BM_CMD_READ) | ATA_BM_CMD_START);
+    } else if (req->write) {
+        // The first block goes out without an interrupt
+        status = ata_poll(ch);
+        if ((status & (ATA_SR_ERR | ATA_SR_DF)) || !(status & ATA_SR_DRQ)) {
+            ata_complete(ch, req, BLK_REQ_ERROR);
+            return;
+        }
+        transfer_out(ch, drive, req);
     }
+}
 
-    // Read the data from the data port
-    uint16_t* ptr = (uint16_t*)buffer;
-    for (int i = 0; i < 256; i++) {
-        ptr[i] = inw(ATA_DATA_PORT);
+// Advance the channel's head request by one step
+static void ata_service(ata_channel_t* ch, uint8_t status) {
+    blk_request_t* req = ch->queue_head;
+    if (req == 0 || (status & ATA_SR_BSY)) {
+        drives[ch->selected].stats.spurious_irqs++;
+        return;
+    }
+    ata_drive_t* drive = req->dev->driver_data;
+    if (status & (ATA_SR_ERR | ATA_SR_DF)) {
+        ata_complete(ch, req, BLK_REQ_ERROR);
+        return;
+    }
+    if (ch->flushing) {
+        ata_complete(ch, req, BLK_REQ_DONE);
+        return;
     }
 
-    kprintf("ATA: Read sector OK\n");
-    return 0;
+    if (req->dma) {
+        // The whole transfer is done: stop the engine and check it
+        uint8_t bm_status = inb(ch->bm_base + ATA_BM_STATUS);
+        outb(ch->bm_base + ATA_BM_COMMAND, 0);
+        outb(ch->bm_base + ATA_BM_STATUS, bm_status | ATA_BM_SR_ERR | ATA_BM_SR_IRQ);
+        if (bm_status & ATA_BM_SR_ERR) {
+            ata_complete(ch, req, BLK_REQ_ERROR);
+            return;
+        }
+        req->transferred = req->count;
+        if (req->write && req->flush) {
+            start_flush(ch, drive);
+        } else {
+            ata_complete(ch, req, BLK_REQ_DONE);
+        }
+        return;
+    }
+
+    if (!req->write) {
+        if (!(status & ATA_SR_DRQ)) {
+            ata_complete(ch, req, BLK_REQ_ERROR);
+            return;
+        }
+        transfer_in(ch, drive, req);
+        if (req->transferred == req->count) {
+            ata_complete(ch, req, BLK_REQ_DONE);
+        }
+        return;
+    }
+
+    req->transferred += block_sectors(drive, req);
+    if (req->transferred < req->count) {
+        transfer_out(ch, drive, req);
+    } else if (req->flush) {
+        start_flush(ch, drive);
+    } else {
+        ata_complete(ch, req, BLK_REQ_DONE);
+    }
+}
+
+static void ata_irq(ata_channel_t* ch) {
+    drives[ch->selected].stats.irqs++;
+    ata_service(ch, inb(ch->io + ATA_REG_STATUS_CMD)); // Reading STATUS acknowledges the IRQ
 }
 
-int ata_write_sector(uint32_t lba, const void* buffer) {
-    uint8_t status;
+static void ata_primary_irq(regs_t* r) {
+    ata_irq(&channels[0]);
+}
 
-    // Wait for drive to be ready to accept commands
-    status = ata_poll();
-    if ((status & ATA_SR_DRDY) == 0) {
-        kprintf("ATA: Drive not ready for write command\n");
-        return -1;
+static void ata_secondary_irq(regs_t* r) {
+    ata_irq(&channels[1]);
+}
+
+static void ata_submit(blockdev_t* dev, blk_request_t* req) {
+    ata_drive_t* drive = dev->driver_data;
+    ata_channel_t* ch = &channels[drive->channel];
+    if (!drive->lba48 && req->lba + req->count > ATA_LBA28_LIMIT) {
+        drive->stats.errors++;
+        req->status = BLK_REQ_ERROR;
+        if (req->done) {
+            req->done(req);
+        }
+        return;
     }
 
-    // Send the command to write sectors
-    outb(ATA_DRIVE_HEAD_PORT, 0xE0 | ((lba >> 24) & 0x0F));
-    outb(ATA_ERROR_PORT, 0x00);
-    outb(ATA_SECTOR_COUNT_PORT, 1);
-    outb(ATA_LBA_LOW_PORT, (uint8_t)lba);
-    outb(ATA_LBA_MID_PORT, (uint8_t)(lba >> 8));
-    outb(ATA_LBA_HIGH_PORT, (uint8_t)(lba >> 16));
-    outb(ATA_STATUS_CMD_PORT, ATA_CMD_WRITE_SECTORS);
+    unsigned int flags = irq_save();
+    if (ch->queue_tail) {
+        ch->queue_tail->next = req;
+    } else {
+        ch->queue_head = req;
+    }
+    ch->queue_tail = req;
+    if (++ch->queue_len > drive->stats.queue_peak) {
+        drive->stats.queue_peak = ch->queue_len;
+    }
+    if (ch->queue_head == req) {
+        ata_start(ch, req);
+    }
+    irq_restore(flags);
+}
 
-    // Wait for drive to be ready for data
-    status = ata_poll();
+// Early boot: interrupts are off, so step the channel by hand
+static void ata_poll_dev(blockdev_t* dev) {
+    ata_drive_t* drive = dev->driver_data;
+    ata_channel_t* ch = &channels[drive->channel];
+    ata_delay(ch);
+    uint8_t status = inb(ch->control); // Alternate status, leaves the IRQ pending
+    if (!(status & ATA_SR_BSY)) {
+        ata_service(ch, inb(ch->io + ATA_REG_STATUS_CMD));
+    }
+}
 
-    // Check for errors
+// IDENTIFY one position and switch the drive to multiple-sector mode.
+// Returns 0 if there is no ATA drive there.
+static int ata_identify(ata_channel_t* ch, ata_drive_t* drive) {
+    uint16_t id[256];
+
+    outb(ch->io + ATA_REG_DRIVE_HEAD, drive->slave ? 0xB0 : 0xA0);
+    ata_delay(ch);
+    outb(ch->io + ATA_REG_SECTOR_COUNT, 0);
+    outb(ch->io + ATA_REG_LBA_LOW, 0);
+    outb(ch->io + ATA_REG_LBA_MID, 0);
+    outb(ch->io + ATA_REG_LBA_HIGH, 0);
+    outb(ch->io + ATA_REG_STATUS_CMD, ATA_CMD_IDENTIFY);
+    if (inb(ch->io + ATA_REG_STATUS_CMD) == 0) {
+        return 0; // Nothing at this position
+    }
+    uint8_t status = ata_poll(ch);
+    if (inb(ch->io + ATA_REG_LBA_MID) || inb(ch->io + ATA_REG_LBA_HIGH)) {
+        return 0; // ATAPI or SATA signature
+    }
+    while (!(status & (ATA_SR_DRQ | ATA_SR_ERR))) {
+        status = inb(ch->io + ATA_REG_STATUS_CMD);
+    }
     if (status & ATA_SR_ERR) {
-        kprintf("ATA: Write error\n");
-        return -1;
+        return 0;
     }
+    insw(ch->io + ATA_REG_DATA, id, 256);
 
-    if (!(status & ATA_SR_DRQ)) {
-        kprintf("ATA: DRQ not set after write\n");
-        return -1;
+    drive->lba48 = (id[83] >> 10) & 1;
+    drive->dma = (id[49] >> 8) & 1;
+    if (drive->lba48 && (id[102] || id[103])) {
+        drive->sectors = 0xFFFFFFFF; // Past what a 32-bit LBA can address
+    } else if (drive->lba48) {
+        drive->sectors = ((uint32_t)id[101] << 16) | id[100];
+    } else {
+        drive->sectors = ((uint32_t)id[61] << 16) | id[60];
     }
 
-    // Write the data to the data port
-    const uint16_t* ptr = (const uint16_t*)buffer;
-    for (int i = 0; i < 256; i++) {
-        outw(ATA_DATA_PORT, ptr[i]);
+    // Words 27-46: model name, two characters per word, high byte first
+    for (int i = 0; i < 20; i++) {
+        drive->model[i * 2] = (char)(id[27 + i] >> 8);
+        drive->model[i * 2 + 1] = (char)id[27 + i];
+    }
+    drive->model[40] = '\0';
+    for (int i = 39; i >= 0 && drive->model[i] == ' '; i--) {
+        drive->model[i] = '\0';
     }
 
-    // Flush the cache
-    outb(ATA_STATUS_CMD_PORT, 0xE7);
-    ata_poll();
+    // Word 47: largest DRQ block READ/WRITE MULTIPLE supports
+    drive->multiple = 1;
+    uint32_t max_multiple = id[47] & 0xFF;
+    if (max_multiple > 1) {
+        outb(ch->io + ATA_REG_SECTOR_COUNT, (uint8_t)max_multiple);
+        outb(ch->io + ATA_REG_STATUS_CMD, ATA_CMD_SET_MULTIPLE);
+        if (!(ata_poll(ch) & ATA_SR_ERR)) {
+            drive->multiple = max_multiple;
+        }
+    }
+    return 1;
+}
 
-    kprintf("ATA: Write sector OK\n");
-    return 0;
-}
\ No newline at end of file
+void ata_init() {
+    for (uint32_t c = 0; c < ATA_CHANNELS; c++) {
+        ata_channel_t* ch = &channels[c];
+
+        // Interrupts stay masked at the drives until the first request
+        outb(ch->control, 0x02);
+        if (inb(ch->io + ATA_REG_STATUS_CMD) == 0xFF) {
+            continue; // Floating bus, no drives on this channel
+        }
+
+        for (uint32_t slave = 0; slave < 2; slave++) {
+            uint32_t index = c * 2 + slave;
+            ata_drive_t* drive = &drives[index];
+            drive->channel = c;
+            drive->slave = slave;
+            if (!ata_identify(ch, drive)) {
+                continue;
+            }
+            drive->present = 1;
+            drive->dev = blockdev_register(drive_names[index], drive->sectors, ATA_MAX_REQUEST,
+                                           ata_submit, ata_poll_dev, drive);
+            klog("ATA", "%s: %s, %u sectors, %u per block, LBA48 %s, DMA %s", drive_names[index],
+                 drive->model, drive->sectors, drive->multiple, drive->lba48 ? "yes" : "no",
+                 drive->dma ? "yes" : "no");
+        }
+        ch->selected = c * 2 + 1; // Force a select before the first request
+    }
+
+    irq_install_handler(ATA_PRIMARY_IRQ, ata_primary_irq);
+    irq_install_handler(ATA_SECONDARY_IRQ, ata_secondary_irq);
+    if (!drives[0].present && !drives[1].present && !drives[2].present && !drives[3].present) {
+        klog("ATA", "No drive found");
+    }
+}
+
+// Called by the PCI scan for an IDE controller (class 0x01, subclass 0x01)
+void ata_dma_init(uint8_t bus, uint8_t dev, uint8_t func) {
+    uint32_t bar4 = pci_config_read(bus, dev, func, 0x20);
+    if (!(bar4 & 1)) {
+        return; // Bus master registers must be in I/O space
+    }
+
+    // Enable I/O decoding and bus mastering
+    uint32_t command = pci_config_read(bus, dev, func, 0x04);
+    pci_config_write(bus, dev, func, 0x04, (command & 0xFFFF) | 0x05);
+
+    unsigned int flags = irq_save();
+    channels[0].bm_base = bar4 & 0xFFFC;
+    channels[1].bm_base = (bar4 & 0xFFFC) + 8;
+    irq_restore(flags);
+    klog("ATA", "Bus master DMA at I/O 0x%04x", bar4 & 0xFFFC);
+}
+
+int ata_dma_enabled(uint32_t channel) {
+    return channel < ATA_CHANNELS && channels[channel].bm_base != 0;
+}
+
+const ata_drive_t* ata_get_drive(uint32_t index) {
+    return index < ATA_DRIVES ? &drives[index] : 0;
+}
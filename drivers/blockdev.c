@@ -0,0 +1,119 @@
+#include "include/blockdev.h"
+#include "include/memcore.h"
+#include "include/cpu.h"
+
+// Drivers register each disk they find; everything above (filesystems,
+// benchmarks) talks to a blockdev_t and never to the controller. Requests
+// are asynchronous, so one caller can keep several devices busy at once.
+static blockdev_t devices[BLOCKDEV_MAX];
+static uint32_t device_count = 0;
+
+blockdev_t* blockdev_register(const char* name, uint32_t sectors, uint32_t max_request,
+                              void (*submit)(blockdev_t*, blk_request_t*),
+                              void (*poll)(blockdev_t*), void* driver_data) {
+    if (device_count == BLOCKDEV_MAX) {
+        return 0;
+    }
+    blockdev_t* dev = &devices[device_count++];
+    memset(dev, 0, sizeof(blockdev_t));
+    strncpy(dev->name, name, sizeof(dev->name) - 1);
+    dev->sectors = sectors;
+    dev->max_request = max_request;
+    dev->submit = submit;
+    dev->poll = poll;
+    dev->driver_data = driver_data;
+    return dev;
+}
+
+uint32_t blockdev_count() {
+    return device_count;
+}
+
+blockdev_t* blockdev_get(uint32_t index) {
+    return index < device_count ? &devices[index] : 0;
+}
+
+blockdev_t* blockdev_find(const char* name) {
+    for (uint32_t i = 0; i < device_count; i++) {
+        if (strcmp(devices[i].name, name) == 0) {
+            return &devices[i];
+        }
+    }
+    return 0;
+}
+
+void blk_submit(blockdev_t* dev, blk_request_t* req) {
+    req->dev = dev;
+    req->status = BLK_REQ_PENDING;
+    req->transferred = 0;
+    req->next = 0;
+    int invalid = req->count > dev->max_request || (req->count == 0 && !req->flush) ||
+                  (uint64_t)req->lba + req->count > dev->sectors;
+    if (invalid) {
+        req->status = BLK_REQ_ERROR;
+        if (req->done) {
+            unsigned int flags = irq_save(); // done runs with interrupts off
+            req->done(req);
+            irq_restore(flags);
+        }
+        return;
+    }
+    dev->submit(dev, req);
+}
+
+// Block until req completes. With interrupts on the CPU halts (or runs other
+// threads) between IRQs; during early boot they are off, so poll instead.
+int blk_wait(blk_request_t* req) {
+    int interrupts = irq_enabled();
+    while (req->status == BLK_REQ_PENDING) {
+        if (interrupts) {
+            // Check again with IRQs off so the completion can't slip in
+            // between the test and the halt
+            asm volatile("cli");
+            if (req->status == BLK_REQ_PENDING) {
+                cpu_idle();
+            }
+            asm volatile("sti");
+        } else {
+            req->dev->poll(req->dev);
+        }
+    }
+    return req->status;
+}
+
+static int blk_transfer(blockdev_t* dev, uint32_t lba, uint32_t count, uint8_t* buffer, int write) {
+    blk_request_t req;
+    while (count > 0) {
+        memset(&req, 0, sizeof(req));
+        req.lba = lba;
+        req.buffer = buffer;
+        req.count = count < dev->max_request ? count : dev->max_request;
+        req.write = write;
+        blk_submit(dev, &req);
+        if (blk_wait(&req) != BLK_REQ_DONE) {
+            return -1;
+        }
+        lba += req.count;
+        buffer += req.count * BLOCKDEV_SECTOR_SIZE;
+        count -= req.count;
+    }
+    return 0;
+}
+
+int blk_read(blockdev_t* dev, uint32_t lba, uint32_t count, void* buffer) {
+    return blk_transfer(dev, lba, count, buffer, 0);
+}
+
+// Data may sit in the device's write cache until the next blk_flush()
+int blk_write(blockdev_t* dev, uint32_t lba, uint32_t count, const void* buffer) {
+    return blk_transfer(dev, lba, count, (uint8_t*)buffer, 1);
+}
+
+// Barrier: returns once everything written before it is on the medium
+int blk_flush(blockdev_t* dev) {
+    blk_request_t req;
+    memset(&req, 0, sizeof(req));
+    req.flush = 1;
+    blk_submit(dev, &req);
+    return blk_wait(&req) == BLK_REQ_DONE ? 0 : -1;
+}
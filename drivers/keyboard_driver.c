@@ -2,6 +2,7 @@
 #include "include/ports.h"
 #include "include/irq.h"
 #include "include/memcore.h"
+#include "include/cpu.h"
 
 #define KBD_DATA_PORT   0x60
 #define KBD_STATUS_PORT 0x64
@@ -16,7 +17,7 @@ unsigned char kbd_us[128] = {
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
 };
-char last_char = 0;
+volatile char last_char = 0;
 static unsigned char last_scancode = 0;
 int ctrl_pressed = 0;
 
@@ -73,13 +74,22 @@ unsigned char keyboard_get_scancode() {
     return sc;
 }
 
+int keyboard_has_char() {
+    return last_char != 0;
+}
+
 char keyboard_get_char_blocking() {
-    char c;
-    do {
-        asm volatile("sti");
-        asm volatile("hlt");
-        c = last_char;
-    } while (c == 0);
+    // Test with IRQs off so a keypress can't land between the check and
+    // the wait; cpu_idle() turns them back on
+    for (;;) {
+        asm volatile("cli");
+        if (last_char != 0) {
+            break;
+        }
+        cpu_idle();
+    }
+    char c = last_char;
     last_char = 0;
+    asm volatile("sti");
     return c;
 }
\ No newline at end of file
@@ -0,0 +1,38 @@
+#include "include/ramdisk.h"
+#include "include/memcore.h"
+#include "include/vma.h"
+#include "include/cpu.h"
+
+// Requests complete at once: submit copies the data and calls done.
+// Pages of the backing area only get a frame once something touches them.
+static void ramdisk_submit(blockdev_t* dev, blk_request_t* req) {
+    uint8_t* sector = (uint8_t*)dev->driver_data + req->lba * BLOCKDEV_SECTOR_SIZE;
+    if (req->write) {
+        memcpy(sector, req->buffer, req->count * BLOCKDEV_SECTOR_SIZE);
+    } else {
+        memcpy(req->buffer, sector, req->count * BLOCKDEV_SECTOR_SIZE);
+    }
+    req->transferred = req->count;
+    req->status = BLK_REQ_DONE;
+    if (req->done) {
+        unsigned int flags = irq_save(); // As if from an IRQ handler
+        req->done(req);
+        irq_restore(flags);
+    }
+}
+
+static void ramdisk_poll(blockdev_t* dev) {
+    // Nothing is ever outstanding
+}
+
+blockdev_t* ramdisk_create(const char* name, uint32_t sectors) {
+    void* area = vma_alloc(sectors * BLOCKDEV_SECTOR_SIZE, VMA_WRITE, PAGE_OWNER_FS_CACHE, name);
+    if (area == 0) {
+        return 0;
+    }
+    blockdev_t* dev = blockdev_register(name, sectors, 256, ramdisk_submit, ramdisk_poll, area);
+    if (dev == 0) {
+        vma_free(area);
+    }
+    return dev;
+}
@@ -2,8 +2,12 @@
 #include "include/bdfs.h"
 #include "include/memcore.h"
 #include "include/colors.h"
+#include "include/paging.h"
 
-#define MAX_BYTECODE_SIZE 1024
+// Programs are loaded at the bottom of the user half of their own address
+// space, one page per 4KB of file
+#define BDX_LOAD_ADDRESS USER_SPACE_START
+#define BDX_MAX_SIZE     0x1000000 // 16MB
 
 void interpret_bdx(uint8_t* bytecode) {
     int ip = 0; // Instruction Pointer
@@ -37,13 +41,55 @@ void interpret_bdx(uint8_t* bytecode) {
 }
 
 int execute_bdx(const char* path) {
-    uint8_t bytecode[MAX_BYTECODE_SIZE];
-    uint32_t bytes_read;
+    int fd = bdfs_open(path, BDFS_O_READ);
+    if (fd < 0) {
+        return -1; // File not found
+    }
+    int size = bdfs_lseek(fd, 0, BDFS_SEEK_END);
+    bdfs_lseek(fd, 0, BDFS_SEEK_SET);
+    if (size <= 0 || (uint32_t)size > BDX_MAX_SIZE) {
+        bdfs_close(fd);
+        return -1;
+    }
+
+    // Each program gets a copy-on-write clone of the caller's address
+    // space, so nothing it writes in the user half outlives it.
+    address_space_t* parent = paging_current_address_space();
+    address_space_t* space = paging_clone_address_space();
+    if (space == 0) {
+        bdfs_close(fd);
+        return -2; // Out of memory
+    }
+
+    paging_switch(space);
+    int result = 0;
+    uint32_t pages = ((uint32_t)size + 0xFFF) / 0x1000;
+    for (uint32_t i = 0; i < pages; i++) {
+        void* frame = pmm_alloc_block();
+        if (frame == 0) {
+            result = -2;
+            break;
+        }
+        map_page((uint32_t)frame, BDX_LOAD_ADDRESS + i * 0x1000, PTE_PRESENT | PTE_RW | PTE_USER);
+        // Fresh frames hold whatever was there before; the tail of the last
+        // page must read as zeroes, not as another program's data
+        memset((void*)(BDX_LOAD_ADDRESS + i * 0x1000), 0, 0x1000);
+    }
 
-    if (bdfs_read_file(path, bytecode, &bytes_read) != 0) {
-        return -1; // File not found or error reading
+    // Stream the program in a page at a time
+    uint8_t* bytecode = (uint8_t*)BDX_LOAD_ADDRESS;
+    for (uint32_t done = 0; result == 0 && done < (uint32_t)size; done += 0x1000) {
+        uint32_t want = (uint32_t)size - done < 0x1000 ? (uint32_t)size - done : 0x1000;
+        if (bdfs_read(fd, bytecode + done, want) != (int)want) {
+            result = -1; // Error reading, or the file shrank
+        }
+    }
+    bdfs_close(fd);
+    if (result == 0) {
+        interpret_bdx(bytecode);
     }
 
-    interpret_bdx(bytecode);
-    return 0;
-}
\ No newline at end of file
+    paging_switch(parent);
+    paging_destroy_address_space(space); // Frees the program's frames too
+    return result;
+}
@@ -0,0 +1,222 @@
+#include "include/bcache.h"
+#include "include/memcore.h"
+#include "include/vma.h"
+#include "include/klog.h"
+
+// Sector-level buffer cache between BDFS and the block devices. Buffers are
+// found through a hash of (device, LBA) and recycled in LRU order. Writes
+// only mark a buffer dirty; dirty sectors reach the disk when bcache_sync()
+// runs (periodically and on `sync`) or when a dirty buffer is evicted, and
+// then adjacent sectors are written with one request.
+//
+// The cache does no locking of its own: its only user, BDFS, serializes
+// every call under its filesystem lock.
+static bcache_buf_t buffers[BCACHE_BLOCKS];
+static bcache_buf_t* hash_table[BCACHE_HASH_BUCKETS];
+static bcache_buf_t* lru_head = 0; // Most recently used
+static bcache_buf_t* lru_tail = 0;
+static uint8_t* staging = 0;       // BCACHE_COALESCE sectors for write-back
+static bcache_buf_t* dirty_list[BCACHE_BLOCKS];
+static bcache_stats_t stats;
+static uint8_t unflushed[BLOCKDEV_MAX]; // Per device: written since its last flush
+
+static uint32_t hash_of(blockdev_t* dev, uint32_t lba) {
+    return (lba ^ ((uint32_t)dev >> 4)) & (BCACHE_HASH_BUCKETS - 1);
+}
+
+static uint8_t* unflushed_flag(blockdev_t* dev) {
+    for (uint32_t i = 0; i < blockdev_count(); i++) {
+        if (blockdev_get(i) == dev) {
+            return &unflushed[i];
+        }
+    }
+    return 0;
+}
+
+static void lru_unlink(bcache_buf_t* buf) {
+    if (buf->lru_prev) {
+        buf->lru_prev->lru_next = buf->lru_next;
+    } else {
+        lru_head = buf->lru_next;
+    }
+    if (buf->lru_next) {
+        buf->lru_next->lru_prev = buf->lru_prev;
+    } else {
+        lru_tail = buf->lru_prev;
+    }
+}
+
+static void lru_push_front(bcache_buf_t* buf) {
+    buf->lru_prev = 0;
+    buf->lru_next = lru_head;
+    if (lru_head) {
+        lru_head->lru_prev = buf;
+    } else {
+        lru_tail = buf;
+    }
+    lru_head = buf;
+}
+
+static void hash_remove(bcache_buf_t* buf) {
+    bcache_buf_t** link = &hash_table[hash_of(buf->dev, buf->lba)];
+    while (*link != buf) {
+        link = &(*link)->hash_next;
+    }
+    *link = buf->hash_next;
+}
+
+void bcache_init() {
+    if (staging != 0) {
+        return;
+    }
+    uint8_t* area = vma_alloc((BCACHE_BLOCKS + BCACHE_COALESCE) * BLOCKDEV_SECTOR_SIZE, VMA_WRITE,
+                              PAGE_OWNER_FS_CACHE, "bcache");
+    if (area == 0) {
+        klog("BCACHE", "Could not reserve the cache area");
+        return;
+    }
+    // Back every page now: the ATA driver can only DMA into mapped pages
+    memset(area, 0, (BCACHE_BLOCKS + BCACHE_COALESCE) * BLOCKDEV_SECTOR_SIZE);
+
+    for (uint32_t i = 0; i < BCACHE_BLOCKS; i++) {
+        buffers[i].data = area + i * BLOCKDEV_SECTOR_SIZE;
+        lru_push_front(&buffers[i]);
+    }
+    staging = area + BCACHE_BLOCKS * BLOCKDEV_SECTOR_SIZE;
+}
+
+// Write every dirty buffer of dev, sorted by LBA so runs of adjacent
+// sectors go out as a single request. Buffers whose last write failed are
+// only retried when asked to, so an eviction doesn't hit the same bad
+// sector again on every miss.
+static int write_back(blockdev_t* dev, int retry_failed) {
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < BCACHE_BLOCKS; i++) {
+        if (buffers[i].dev == dev && buffers[i].dirty && (retry_failed || !buffers[i].write_failed)) {
+            bcache_buf_t* buf = &buffers[i];
+            uint32_t j = count++;
+            while (j > 0 && dirty_list[j - 1]->lba > buf->lba) {
+                dirty_list[j] = dirty_list[j - 1];
+                j--;
+            }
+            dirty_list[j] = buf;
+        }
+    }
+
+    int result = 0;
+    uint32_t i = 0;
+    while (i < count) {
+        uint32_t run = 1;
+        while (i + run < count && run < BCACHE_COALESCE &&
+               dirty_list[i + run]->lba == dirty_list[i]->lba + run) {
+            run++;
+        }
+        for (uint32_t j = 0; j < run; j++) {
+            memcpy(staging + j * BLOCKDEV_SECTOR_SIZE, dirty_list[i + j]->data, BLOCKDEV_SECTOR_SIZE);
+        }
+        if (blk_write(dev, dirty_list[i]->lba, run, staging) == 0) {
+            for (uint32_t j = 0; j < run; j++) {
+                dirty_list[i + j]->dirty = 0;
+                dirty_list[i + j]->write_failed = 0;
+            }
+            stats.dirty -= run;
+            stats.writeback_requests++;
+            stats.writeback_sectors += run;
+            uint8_t* flag = unflushed_flag(dev);
+            if (flag) {
+                *flag = 1;
+            }
+        } else {
+            klog("BCACHE", "%s: write-back of LBA %u-%u failed", dev->name, dirty_list[i]->lba,
+                 dirty_list[i]->lba + run - 1);
+            for (uint32_t j = 0; j < run; j++) {
+                dirty_list[i + j]->write_failed = 1;
+            }
+            result = -1;
+        }
+        i += run;
+    }
+    return result;
+}
+
+bcache_buf_t* bcache_get(blockdev_t* dev, uint32_t lba, uint32_t flags) {
+    for (bcache_buf_t* buf = hash_table[hash_of(dev, lba)]; buf; buf = buf->hash_next) {
+        if (buf->dev == dev && buf->lba == lba) {
+            stats.hits++;
+            buf->pins++;
+            lru_unlink(buf);
+            lru_push_front(buf);
+            return buf;
+        }
+    }
+    stats.misses++;
+
+    // Least recently used unpinned buffer that is clean, or can be made
+    // clean. One whose write-back fails stays cached (and dirty) for a later
+    // sync to retry, and the search moves on.
+    bcache_buf_t* victim = lru_tail;
+    while (victim) {
+        if (victim->pins == 0 && !victim->write_failed) {
+            if (!victim->dirty) {
+                break;
+            }
+            // Take the rest of the device's dirty sectors along while at it
+            stats.dirty_evictions++;
+            write_back(victim->dev, 0);
+            if (!victim->dirty) {
+                break;
+            }
+        }
+        victim = victim->lru_prev;
+    }
+    if (victim == 0) {
+        return 0;
+    }
+    if (victim->dev) {
+        stats.evictions++;
+        hash_remove(victim);
+        victim->dev = 0;
+    }
+
+    if (!(flags & BCACHE_NOREAD) && blk_read(dev, lba, 1, victim->data) < 0) {
+        return 0;
+    }
+    victim->dev = dev;
+    victim->lba = lba;
+    victim->pins = 1;
+    uint32_t bucket = hash_of(dev, lba);
+    victim->hash_next = hash_table[bucket];
+    hash_table[bucket] = victim;
+    lru_unlink(victim);
+    lru_push_front(victim);
+    return victim;
+}
+
+void bcache_put(bcache_buf_t* buf) {
+    buf->pins--;
+}
+
+void bcache_mark_dirty(bcache_buf_t* buf) {
+    if (!buf->dirty) {
+        buf->dirty = 1;
+        stats.dirty++;
+    }
+}
+
+int bcache_sync(blockdev_t* dev) {
+    stats.syncs++;
+    int result = write_back(dev, 1);
+    // An idle periodic sync costs nothing, not even a drive flush
+    uint8_t* flag = unflushed_flag(dev);
+    if (flag && *flag) {
+        if (blk_flush(dev) < 0) {
+            result = -1;
+        }
+        *flag = 0;
+    }
+    return result;
+}
+
+const bcache_stats_t* bcache_get_stats() {
+    return &stats;
+}
@@ -1,37 +1,326 @@
 #include "include/bdfs.h"
 #include "include/memcore.h"
 #include "include/colors.h"
+#include "include/klog.h"
+#include "include/bcache.h"
+#include "include/ramdisk.h"
+#include "include/cpu.h"
+#include "include/sched.h"
+#include "include/heap.h"
 
-// In-memory storage for BDFS. The layout is:
-// - First BDFS_FILE_TABLE_SECTORS * 512 bytes: File table (with magic number)
+// BDFS lives on a block device (BDFS_DEVICE, or a RAM disk when that is
+// missing). The layout is:
+// - Sector 0: Superblock (magic, version, layout)
+// - Sectors 1-4: File table
+// - Sectors 5-12: Extent table, BDFS_MAX_EXTENTS runs per file
 // - The rest: File data
-#define BDFS_DATA_SECTORS 64 // Space for file content
-#define BDFS_TOTAL_SECTORS (BDFS_FILE_TABLE_SECTORS + BDFS_DATA_SECTORS)
-static uint8_t bdfs_storage[BDFS_TOTAL_SECTORS * 512];
+// Every access goes through the buffer cache. Changes are written back by
+// the bsync thread every few seconds, by `sync`, or when the cache needs
+// the buffer.
+static blockdev_t* bdfs_dev = 0;
+static uint32_t bdfs_data_sectors = 0;
 
 static bdfs_file_entry_t file_table[BDFS_MAX_FILES];
+static bdfs_extent_t extents[BDFS_MAX_FILES][BDFS_MAX_EXTENTS];
 static uint32_t current_dir_inode = 0; // Root directory is inode 0
 
-// Helper to find an entry (file or dir) in a specific directory
-static int find_entry_in_dir(const char* name, uint32_t parent_inode) {
-    for (int i = 0; i < BDFS_MAX_FILES; i++) {
-        if (file_table[i].name[0] != '\0' && file_table[i].parent_inode == parent_inode && strcmp(file_table[i].name, name) == 0) {
-            return i;
+// Serializes the shell and the bsync thread. Held across disk I/O, so
+// waiters sleep until it is released; a waiter that kept yielding would be
+// picked over a preempted LOW-priority holder and never let it finish.
+static volatile int fs_busy = 0;
+static wait_queue_t fs_waiters;
+
+static void fs_lock() {
+    unsigned int flags = irq_save();
+    while (fs_busy) {
+        sched_wait(&fs_waiters);
+    }
+    fs_busy = 1;
+    irq_restore(flags);
+}
+
+static void fs_unlock() {
+    unsigned int flags = irq_save();
+    fs_busy = 0;
+    sched_wake_all(&fs_waiters);
+    irq_restore(flags);
+}
+
+// Table sectors whose entries changed since they were last copied to the
+// cache. Metadata changes only set a flag here; the copy (and the disk
+// write) happens once per sync, however many times the entries changed.
+static uint8_t table_dirty[BDFS_FILE_TABLE_SECTORS];
+static uint8_t extent_dirty[BDFS_EXTENT_TABLE_SECTORS];
+
+static void mark_entry_dirty(uint32_t index) {
+    table_dirty[index / BDFS_ENTRIES_PER_SECTOR] = 1;
+}
+
+static void mark_extents_dirty(uint32_t index) {
+    extent_dirty[index / BDFS_FILES_PER_EXTENT_SECTOR] = 1;
+}
+
+// Free-space bitmap of the data area, one bit per sector, set = in use.
+// It is not stored: the mount builds it from the extent table.
+static uint8_t* used_map = 0;
+static uint32_t free_sectors = 0;
+
+static int sector_used(uint32_t sector) {
+    return used_map[sector >> 3] & (1 << (sector & 7));
+}
+
+static void mark_sectors(uint32_t start, uint32_t count, int used) {
+    for (uint32_t s = start; s < start + count; s++) {
+        if (used) {
+            used_map[s >> 3] |= 1 << (s & 7);
+        } else {
+            used_map[s >> 3] &= ~(1 << (s & 7));
         }
     }
-    return -1;
+    if (used) {
+        free_sectors -= count;
+    } else {
+        free_sectors += count;
+    }
 }
 
-// Find a free entry in the file table
-static int find_free_entry() {
+static void build_used_map() {
+    memset(used_map, 0, (bdfs_data_sectors + 7) / 8);
+    free_sectors = bdfs_data_sectors;
+    for (int i = 1; i < BDFS_MAX_FILES; i++) {
+        if (file_table[i].name[0] == '\0' || file_table[i].type != BDFS_FILE_TYPE_FILE) {
+            continue;
+        }
+        for (uint32_t e = 0; e < file_table[i].extent_count; e++) {
+            mark_sectors(extents[i][e].start, extents[i][e].count, 1);
+        }
+    }
+}
+
+// Free sectors starting at start, counting up to max
+static uint32_t free_run_at(uint32_t start, uint32_t max) {
+    uint32_t run = 0;
+    while (run < max && start + run < bdfs_data_sectors && !sector_used(start + run)) {
+        run++;
+    }
+    return run;
+}
+
+// First free run of at least want sectors. Failing that, the longest run
+// there is. Returns its length (0 when the disk is full) and its start.
+static uint32_t find_free_run(uint32_t want, uint32_t* start) {
+    uint32_t best = 0;
+    uint32_t s = 0;
+    while (s < bdfs_data_sectors) {
+        if (used_map[s >> 3] == 0xFF && (s & 7) == 0) {
+            s += 8; // Skip full bytes
+            continue;
+        }
+        if (sector_used(s)) {
+            s++;
+            continue;
+        }
+        uint32_t run = free_run_at(s, want);
+        if (run > best) {
+            best = run;
+            *start = s;
+            if (run == want) {
+                break;
+            }
+        }
+        s += run;
+    }
+    return best;
+}
+
+static uint32_t file_sectors(int index) {
+    uint32_t total = 0;
+    for (uint32_t e = 0; e < file_table[index].extent_count; e++) {
+        total += extents[index][e].count;
+    }
+    return total;
+}
+
+// Drop sectors from the end of the file until it has `sectors` left
+static void shrink_file(int index, uint32_t sectors) {
+    bdfs_file_entry_t* file = &file_table[index];
+    uint32_t total = file_sectors(index);
+    while (total > sectors) {
+        bdfs_extent_t* last = &extents[index][file->extent_count - 1];
+        uint32_t drop = total - sectors < last->count ? total - sectors : last->count;
+        mark_sectors(last->start + last->count - drop, drop, 0);
+        last->count -= drop;
+        total -= drop;
+        if (last->count == 0) {
+            file->extent_count--;
+        }
+    }
+    mark_entry_dirty(index);
+    mark_extents_dirty(index);
+}
+
+// Grow or shrink the file's allocation to exactly `sectors`. New space
+// continues the last extent when the sectors after it are free, otherwise
+// it comes from the first free run big enough. Returns -1 (leaving the
+// file as it was) if the disk is full or the file would need more than
+// BDFS_MAX_EXTENTS runs.
+static int resize_file(int index, uint32_t sectors) {
+    bdfs_file_entry_t* file = &file_table[index];
+    uint32_t old_total = file_sectors(index);
+    uint32_t total = old_total;
+    if (sectors <= total) {
+        shrink_file(index, sectors);
+        return 0;
+    }
+    if (sectors - total > free_sectors) {
+        return -1;
+    }
+
+    while (total < sectors) {
+        uint32_t want = sectors - total;
+        bdfs_extent_t* last = file->extent_count ? &extents[index][file->extent_count - 1] : 0;
+        uint32_t start = 0;
+        uint32_t run = 0;
+        if (last && free_run_at(last->start + last->count, want) == want) {
+            start = last->start + last->count;
+            run = want;
+        } else {
+            run = find_free_run(want, &start);
+        }
+
+        if (last && start == last->start + last->count) {
+            last->count += run;
+        } else if (file->extent_count < BDFS_MAX_EXTENTS) {
+            extents[index][file->extent_count].start = start;
+            extents[index][file->extent_count].count = run;
+            file->extent_count++;
+        } else {
+            shrink_file(index, old_total);
+            return -1; // Too fragmented, see bdfs_defrag()
+        }
+        mark_sectors(start, run, 1);
+        total += run;
+    }
+    mark_entry_dirty(index);
+    mark_extents_dirty(index);
+    return 0;
+}
+
+// Device LBA of the file's nth data sector
+static uint32_t file_lba(int index, uint32_t n) {
+    for (uint32_t e = 0; e < file_table[index].extent_count; e++) {
+        if (n < extents[index][e].count) {
+            return BDFS_DATA_SECTOR_START + extents[index][e].start + n;
+        }
+        n -= extents[index][e].count;
+    }
+    return 0; // Past the allocation
+}
+
+// In-memory directory index, rebuilt at mount and kept up to date by every
+// change: a hash of (parent, name) for lookups, a child list per directory
+// for listings, and a list of free entries. All links are entry indices,
+// -1 ends a list. The root (entry 0) is in neither the hash nor a child list.
+static int hash_head[BDFS_HASH_BUCKETS];
+static int hash_next[BDFS_MAX_FILES];   // Also links the free list
+static int first_child[BDFS_MAX_FILES];
+static int next_sibling[BDFS_MAX_FILES];
+static int free_head = -1;
+
+// Open file descriptors; entry is -1 for a free slot
+typedef struct {
+    int entry;
+    uint32_t offset;
+    uint32_t flags;
+} bdfs_fd_t;
+
+static bdfs_fd_t open_files[BDFS_MAX_OPEN];
+static uint8_t open_count[BDFS_MAX_FILES]; // Descriptors per entry
+
+static uint32_t name_hash(const char* name, uint32_t parent_inode) {
+    uint32_t hash = 2166136261u ^ parent_inode; // FNV-1a
+    while (*name) {
+        hash = (hash ^ (uint8_t)*name++) * 16777619u;
+    }
+    return hash & (BDFS_HASH_BUCKETS - 1);
+}
+
+// Add a used entry to its directory, keeping children in table order
+static void index_insert(int index) {
+    bdfs_file_entry_t* entry = &file_table[index];
+    uint32_t bucket = name_hash(entry->name, entry->parent_inode);
+    hash_next[index] = hash_head[bucket];
+    hash_head[bucket] = index;
+
+    int* link = &first_child[entry->parent_inode];
+    while (*link != -1 && *link < index) {
+        link = &next_sibling[*link];
+    }
+    next_sibling[index] = *link;
+    *link = index;
+}
+
+static void index_remove(int index) {
+    bdfs_file_entry_t* entry = &file_table[index];
+    int* link = &hash_head[name_hash(entry->name, entry->parent_inode)];
+    while (*link != index) {
+        link = &hash_next[*link];
+    }
+    *link = hash_next[index];
+
+    link = &first_child[entry->parent_inode];
+    while (*link != index) {
+        link = &next_sibling[*link];
+    }
+    *link = next_sibling[index];
+}
+
+static void index_rebuild() {
+    for (int i = 0; i < BDFS_HASH_BUCKETS; i++) {
+        hash_head[i] = -1;
+    }
     for (int i = 0; i < BDFS_MAX_FILES; i++) {
+        first_child[i] = -1;
+    }
+    free_head = -1;
+    // Backwards, so the free list comes out in table order
+    for (int i = BDFS_MAX_FILES - 1; i > 0; i--) {
         if (file_table[i].name[0] == '\0') {
+            hash_next[i] = free_head;
+            free_head = i;
+        } else if (file_table[i].parent_inode < BDFS_MAX_FILES) {
+            index_insert(i);
+        }
+    }
+}
+
+// Helper to find an entry (file or dir) in a specific directory
+static int find_entry_in_dir(const char* name, uint32_t parent_inode) {
+    for (int i = hash_head[name_hash(name, parent_inode)]; i != -1; i = hash_next[i]) {
+        if (file_table[i].parent_inode == parent_inode && strcmp(file_table[i].name, name) == 0) {
             return i;
         }
     }
     return -1;
 }
 
+// Take an entry off the free list. The caller fills it in and indexes it.
+static int find_free_entry() {
+    int index = free_head;
+    if (index != -1) {
+        free_head = hash_next[index];
+    }
+    return index;
+}
+
+static void release_entry(int index) {
+    index_remove(index);
+    file_table[index].name[0] = '\0';
+    hash_next[index] = free_head;
+    free_head = index;
+    mark_entry_dirty(index);
+}
+
 // Helper to create a directory entry without syncing
 static int bdfs_create_dir_entry(const char* dirname, uint32_t parent_inode) {
     if (strlen(dirname) >= BDFS_MAX_FILENAME_LENGTH) return -1;
@@ -43,57 +332,389 @@ static int bdfs_create_dir_entry(const char* dirname, uint32_t parent_inode) {
     strcpy(file_table[free_index].name, dirname);
     file_table[free_index].type = BDFS_FILE_TYPE_DIRECTORY;
     file_table[free_index].parent_inode = parent_inode;
-    file_table[free_index].start_sector = 0; // Not used for dirs
+    file_table[free_index].extent_count = 0; // Not used for dirs
     file_table[free_index].length = 0; // Not used for dirs
-    
+    index_insert(free_index);
+    mark_entry_dirty(free_index);
+
     return free_index;
 }
 
+static void bsync_thread(void* arg) {
+    for (;;) {
+        sched_sleep_us(BCACHE_SYNC_INTERVAL_US);
+        bdfs_sync();
+    }
+}
+
+static void flush_table_locked();
+
+// Write a current-version superblock and all of the tables. Called at
+// mount, before bsync runs, or with the filesystem lock held.
+static int write_superblock() {
+    bcache_buf_t* buf = bcache_get(bdfs_dev, BDFS_SUPERBLOCK_SECTOR, BCACHE_NOREAD);
+    if (buf == 0) {
+        return -1;
+    }
+    memset(buf->data, 0, BLOCKDEV_SECTOR_SIZE);
+    bdfs_superblock_t* sb = (bdfs_superblock_t*)buf->data;
+    sb->magic = BDFS_MAGIC;
+    sb->version = BDFS_VERSION;
+    sb->total_sectors = bdfs_dev->sectors;
+    sb->table_start = BDFS_FILE_TABLE_START;
+    sb->table_sectors = BDFS_FILE_TABLE_SECTORS;
+    sb->extent_table_start = BDFS_EXTENT_TABLE_START;
+    sb->extent_table_sectors = BDFS_EXTENT_TABLE_SECTORS;
+    sb->data_start = BDFS_DATA_SECTOR_START;
+    bcache_mark_dirty(buf);
+    bcache_put(buf);
+
+    memset(table_dirty, 1, sizeof(table_dirty));
+    memset(extent_dirty, 1, sizeof(extent_dirty));
+    flush_table_locked();
+    return bcache_sync(bdfs_dev);
+}
+
+static int bdfs_format() {
+    memset(file_table, 0, sizeof(file_table));
+    memset(extents, 0, sizeof(extents));
+    build_used_map();
+
+    // Create root directory at inode 0
+    strcpy(file_table[0].name, "/");
+    file_table[0].type = BDFS_FILE_TYPE_DIRECTORY;
+    file_table[0].parent_inode = 0; // Root's parent is itself
+    file_table[0].length = 0;
+    index_rebuild();
+
+    // Create default directories
+    bdfs_create_dir_entry("soul", 0);
+    bdfs_create_dir_entry("cortex", 0);
+    int vault_inode = bdfs_create_dir_entry("vault", 0);
+    bdfs_create_dir_entry("chrome", 0);
+    bdfs_create_dir_entry("drift", 0);
+    bdfs_create_dir_entry("ghost", 0);
+
+    if (vault_inode >= 0) {
+        bdfs_create_dir_entry("cypher", vault_inode);
+    }
+
+    return write_superblock();
+}
+
+static int load_region(uint32_t lba, uint32_t sectors, uint8_t* dest) {
+    for (uint32_t i = 0; i < sectors; i++) {
+        bcache_buf_t* buf = bcache_get(bdfs_dev, lba + i, 0);
+        if (buf == 0) {
+            return -1;
+        }
+        memcpy(dest + i * BLOCKDEV_SECTOR_SIZE, buf->data, BLOCKDEV_SECTOR_SIZE);
+        bcache_put(buf);
+    }
+    return 0;
+}
+
+// Copy count sectors between device LBAs, lowest first
+static int copy_sectors(uint32_t from, uint32_t to, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        bcache_buf_t* src = bcache_get(bdfs_dev, from + i, 0);
+        if (src == 0) {
+            return -1;
+        }
+        bcache_buf_t* dst = bcache_get(bdfs_dev, to + i, BCACHE_NOREAD);
+        if (dst == 0) {
+            bcache_put(src);
+            return -1;
+        }
+        memcpy(dst->data, src->data, BLOCKDEV_SECTOR_SIZE);
+        bcache_mark_dirty(dst);
+        bcache_put(dst);
+        bcache_put(src);
+    }
+    return 0;
+}
+
+// Version 1 had no extent table: each file was one run starting at data
+// sector start_sector (the field extent_count has now), and the data area
+// began right after the file table, where the extent table is now.
+#define BDFS_V1_DATA_SECTOR_START (BDFS_FILE_TABLE_START + BDFS_FILE_TABLE_SECTORS)
+
+// Convert a version 1 filesystem in place, with file_table already loaded
+// from it. Files past the new extent table become one extent each without
+// moving; files that started inside it are copied out first. Nothing of the
+// old layout is overwritten until every file has its new home.
+static int migrate_v1() {
+    uint32_t v1_lba[BDFS_MAX_FILES];
+    memset(extents, 0, sizeof(extents));
+    for (int i = 0; i < BDFS_MAX_FILES; i++) {
+        bdfs_file_entry_t* file = &file_table[i];
+        v1_lba[i] = 0;
+        if (file->name[0] == '\0' || file->type != BDFS_FILE_TYPE_FILE) {
+            file->extent_count = 0;
+            continue;
+        }
+        uint32_t lba = BDFS_V1_DATA_SECTOR_START + file->extent_count;
+        uint32_t sectors = (file->length + BLOCKDEV_SECTOR_SIZE - 1) / BLOCKDEV_SECTOR_SIZE;
+        file->extent_count = 0;
+        if (sectors == 0) {
+            continue;
+        }
+        if (lba + sectors > bdfs_dev->sectors) {
+            return -1; // Corrupt entry
+        }
+        if (lba >= BDFS_DATA_SECTOR_START) {
+            extents[i][0].start = lba - BDFS_DATA_SECTOR_START;
+            extents[i][0].count = sectors;
+            file->extent_count = 1;
+        } else {
+            v1_lba[i] = lba;
+        }
+    }
+
+    // Keep the old sectors of the files being moved out of the way of the
+    // new allocations until they have been copied
+    build_used_map();
+    for (int i = 0; i < BDFS_MAX_FILES; i++) {
+        uint32_t end = v1_lba[i] + (file_table[i].length + BLOCKDEV_SECTOR_SIZE - 1) / BLOCKDEV_SECTOR_SIZE;
+        if (v1_lba[i] != 0 && end > BDFS_DATA_SECTOR_START) {
+            for (uint32_t s = BDFS_DATA_SECTOR_START; s < end; s++) {
+                if (!sector_used(s - BDFS_DATA_SECTOR_START)) {
+                    mark_sectors(s - BDFS_DATA_SECTOR_START, 1, 1);
+                }
+            }
+        }
+    }
+    for (int i = 0; i < BDFS_MAX_FILES; i++) {
+        if (v1_lba[i] == 0) {
+            continue;
+        }
+        uint32_t sectors = (file_table[i].length + BLOCKDEV_SECTOR_SIZE - 1) / BLOCKDEV_SECTOR_SIZE;
+        if (resize_file(i, sectors) < 0) {
+            return -1; // No room to move it
+        }
+        for (uint32_t n = 0; n < sectors; n++) {
+            if (copy_sectors(v1_lba[i] + n, file_lba(i, n), 1) < 0) {
+                return -1;
+            }
+        }
+    }
+    build_used_map();
+
+    // The copies have to be on disk before the tables that point at them
+    if (bcache_sync(bdfs_dev) < 0) {
+        return -1;
+    }
+    index_rebuild();
+    return write_superblock();
+}
+
+// Every extent of every file has to lie inside the data area
+static int extents_valid() {
+    for (int i = 1; i < BDFS_MAX_FILES; i++) {
+        if (file_table[i].name[0] == '\0' || file_table[i].type != BDFS_FILE_TYPE_FILE) {
+            continue;
+        }
+        if (file_table[i].extent_count > BDFS_MAX_EXTENTS) {
+            return 0;
+        }
+        for (uint32_t e = 0; e < file_table[i].extent_count; e++) {
+            if (extents[i][e].start >= bdfs_data_sectors ||
+                extents[i][e].count > bdfs_data_sectors - extents[i][e].start) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// Returns 1 if a filesystem was found and its tables loaded, 0 if the
+// device holds none, -1 if it holds one that can't be mounted
+static int bdfs_load() {
+    bcache_buf_t* buf = bcache_get(bdfs_dev, BDFS_SUPERBLOCK_SECTOR, 0);
+    if (buf == 0) {
+        return -1;
+    }
+    bdfs_superblock_t sb = *(bdfs_superblock_t*)buf->data;
+    int blank = 1;
+    for (uint32_t i = 0; i < BLOCKDEV_SECTOR_SIZE; i++) {
+        if (buf->data[i] != 0) {
+            blank = 0;
+            break;
+        }
+    }
+    bcache_put(buf);
+    if (sb.magic != BDFS_MAGIC) {
+        // Only a blank disk gets formatted on its own; anything else may be
+        // a partition table or another filesystem
+        if (!blank) {
+            klog("BDFS", "%s does not hold BDFS, `format %s` erases it", bdfs_dev->name, bdfs_dev->name);
+            return -1;
+        }
+        return 0;
+    }
+    if (sb.total_sectors > bdfs_dev->sectors) {
+        klog("BDFS", "%s is smaller than its filesystem (%u sectors)", bdfs_dev->name, sb.total_sectors);
+        return -1;
+    }
+    if (sb.version != 1 && sb.version != BDFS_VERSION) {
+        klog("BDFS", "%s holds BDFS version %u, expected %u", bdfs_dev->name, sb.version, BDFS_VERSION);
+        return -1;
+    }
+
+    if (load_region(BDFS_FILE_TABLE_START, BDFS_FILE_TABLE_SECTORS, (uint8_t*)file_table) < 0) {
+        return -1;
+    }
+    if (sb.version == 1) {
+        klog("BDFS", "Converting %s from BDFS version 1", bdfs_dev->name);
+        if (migrate_v1() < 0) {
+            klog("BDFS", "Could not convert %s", bdfs_dev->name);
+            return -1;
+        }
+        return 1;
+    }
+    if (load_region(BDFS_EXTENT_TABLE_START, BDFS_EXTENT_TABLE_SECTORS, (uint8_t*)extents) < 0) {
+        return -1;
+    }
+    if (!extents_valid()) {
+        klog("BDFS", "%s has a corrupt extent table", bdfs_dev->name);
+        return -1;
+    }
+    index_rebuild();
+    build_used_map();
+    return 1;
+}
+
+// Make dev the filesystem's device and size the free-space bitmap for it.
+// On failure the previous device stays attached.
+static int attach_device(blockdev_t* dev) {
+    if (dev->sectors <= BDFS_DATA_SECTOR_START) {
+        return -1;
+    }
+    uint32_t data_sectors = dev->sectors - BDFS_DATA_SECTOR_START;
+    uint8_t* map = kmalloc((data_sectors + 7) / 8);
+    if (map == 0) {
+        klog("BDFS", "No memory for the free-space bitmap");
+        return -1;
+    }
+    kfree(used_map);
+    used_map = map;
+    bdfs_dev = dev;
+    bdfs_data_sectors = data_sectors;
+    return 0;
+}
+
+// Only a blank disk is formatted here. One holding anything else, or a
+// filesystem that can't be mounted, is left alone: BDFS runs from a RAM
+// disk instead, as when the disk is missing, until `format` erases it.
 void bdfs_init() {
-    // The "disk" is now in memory. Let's check the magic number.
-    uint32_t* magic_ptr = (uint32_t*)bdfs_storage;
-
-    if (*magic_ptr != BDFS_MAGIC) {
-        kprintf("BDFS: No filesystem found, creating a new one in RAM.\n");
-        memset(file_table, 0, sizeof(file_table));
-        
-        // Create root directory at inode 0
-        strcpy(file_table[0].name, "/");
-        file_table[0].type = BDFS_FILE_TYPE_DIRECTORY;
-        file_table[0].parent_inode = 0; // Root's parent is itself
-        file_table[0].length = 0;
-
-        // Create default directories
-        bdfs_create_dir_entry("soul", 0);
-        bdfs_create_dir_entry("cortex", 0);
-        int vault_inode = bdfs_create_dir_entry("vault", 0);
-        bdfs_create_dir_entry("chrome", 0);
-        bdfs_create_dir_entry("drift", 0);
-        bdfs_create_dir_entry("ghost", 0);
-
-        if (vault_inode >= 0) {
-            bdfs_create_dir_entry("cypher", vault_inode);
-        }
-
-        bdfs_sync_file_table(); // "Save" to RAM disk
+    bcache_init();
+    for (int fd = 0; fd < BDFS_MAX_OPEN; fd++) {
+        open_files[fd].entry = -1;
+    }
+    int found = 0;
+    blockdev_t* disk = blockdev_find(BDFS_DEVICE);
+    if (disk == 0) {
+        klog("BDFS", "No %s, using a RAM disk", BDFS_DEVICE);
+    } else if (attach_device(disk) == 0) {
+        found = bdfs_load();
+        if (found < 0) {
+            klog("BDFS", "Not mounting %s, using a RAM disk. Its data is untouched.", disk->name);
+            bdfs_dev = 0;
+        }
+    }
+    if (bdfs_dev == 0) {
+        blockdev_t* ram = ramdisk_create("ram0", BDFS_RAMDISK_SECTORS);
+        if (ram == 0) {
+            klog("BDFS", "Could not reserve the RAM disk");
+            return;
+        }
+        if (attach_device(ram) < 0) {
+            return;
+        }
+        found = 0;
+    }
+
+    if (!found) {
+        klog("BDFS", "No filesystem found, creating a new one on %s.", bdfs_dev->name);
+        bdfs_format();
     } else {
-        // Filesystem exists in RAM, load it
-        memcpy(file_table, bdfs_storage + sizeof(uint32_t), sizeof(file_table));
+        klog("BDFS", "Mounted %s", bdfs_dev->name);
     }
     current_dir_inode = 0; // Start at the root
+    thread_create("bsync", bsync_thread, 0, SCHED_PRIORITY_LOW);
+}
+
+// Erase the named device and mount a fresh filesystem on it
+int bdfs_format_device(const char* name) {
+    blockdev_t* dev = blockdev_find(name);
+    if (dev == 0) {
+        return -1;
+    }
+    fs_lock();
+    for (int fd = 0; fd < BDFS_MAX_OPEN; fd++) {
+        if (open_files[fd].entry != -1) {
+            fs_unlock();
+            return -2; // Files still open
+        }
+    }
+    if (attach_device(dev) < 0) {
+        fs_unlock();
+        return -3;
+    }
+    int result = bdfs_format() < 0 ? -4 : 0;
+    current_dir_inode = 0;
+    fs_unlock();
+    klog("BDFS", "Formatted and mounted %s", dev->name);
+    return result;
 }
 
+static void flush_region(uint8_t* dirty, uint32_t sectors, uint32_t lba, const uint8_t* src) {
+    for (uint32_t i = 0; i < sectors; i++) {
+        if (!dirty[i]) {
+            continue;
+        }
+        bcache_buf_t* buf = bcache_get(bdfs_dev, lba + i, BCACHE_NOREAD);
+        if (buf == 0) {
+            klog("BDFS", "Could not update metadata sector %u", lba + i);
+            continue;
+        }
+        memcpy(buf->data, src + i * BLOCKDEV_SECTOR_SIZE, BLOCKDEV_SECTOR_SIZE);
+        bcache_mark_dirty(buf);
+        bcache_put(buf);
+        dirty[i] = 0;
+    }
+}
+
+// Copy the changed table sectors into the cache
+static void flush_table_locked() {
+    flush_region(table_dirty, BDFS_FILE_TABLE_SECTORS, BDFS_FILE_TABLE_START, (uint8_t*)file_table);
+    flush_region(extent_dirty, BDFS_EXTENT_TABLE_SECTORS, BDFS_EXTENT_TABLE_START, (uint8_t*)extents);
+}
+
+// Stage the changed table sectors in the cache. They reach the disk with
+// the next sync.
 void bdfs_sync_file_table() {
-    // "Sync" means writing the file table to our in-memory storage.
-    // The file table is stored at the beginning of our bdfs_storage.
-    uint8_t* file_table_ptr = bdfs_storage;
-    
-    memset(file_table_ptr, 0, BDFS_FILE_TABLE_SECTORS * 512);
-    *(uint32_t*)file_table_ptr = BDFS_MAGIC;
-    memcpy(file_table_ptr + sizeof(uint32_t), file_table, sizeof(file_table));
+    fs_lock();
+    flush_table_locked();
+    fs_unlock();
 }
 
-int bdfs_create_file(const char* filename) {
+int bdfs_sync() {
+    if (bdfs_dev == 0) {
+        return -1;
+    }
+    fs_lock();
+    flush_table_locked();
+    int result = bcache_sync(bdfs_dev);
+    fs_unlock();
+    return result;
+}
+
+const char* bdfs_get_device_name() {
+    return bdfs_dev ? bdfs_dev->name : "none";
+}
+
+static int create_file_locked(const char* filename) {
     if (strlen(filename) >= BDFS_MAX_FILENAME_LENGTH) return -1;
     if (find_entry_in_dir(filename, current_dir_inode) != -1) return -2;
 
@@ -103,34 +724,47 @@ int bdfs_create_file(const char* filename) {
     strcpy(file_table[free_index].name, filename);
     file_table[free_index].type = BDFS_FILE_TYPE_FILE;
     file_table[free_index].parent_inode = current_dir_inode;
-    file_table[free_index].start_sector = 0;
+    file_table[free_index].extent_count = 0;
     file_table[free_index].length = 0;
-    
-    bdfs_sync_file_table();
+    index_insert(free_index);
+    mark_entry_dirty(free_index);
     return 0;
 }
 
+int bdfs_create_file(const char* filename) {
+    fs_lock();
+    int result = create_file_locked(filename);
+    fs_unlock();
+    return result;
+}
+
 int bdfs_mkdir(const char* dirname) {
+    fs_lock();
     int result = bdfs_create_dir_entry(dirname, current_dir_inode);
-    if (result >= 0) {
-        bdfs_sync_file_table();
-        return 0;
-    }
-    return result;
+    fs_unlock();
+    return result >= 0 ? 0 : result;
 }
 
-int bdfs_delete_file(const char* filename) {
+static int delete_file_locked(const char* filename) {
     int file_index = find_entry_in_dir(filename, current_dir_inode);
     if (file_index == -1) return -1;
+    if (open_count[file_index] > 0) return -3; // Still open
 
-    // TODO: If it's a directory, ensure it's empty first.
-    // For now, we just delete the entry.
-    file_table[file_index].name[0] = '\0';
-    bdfs_sync_file_table();
+    if (first_child[file_index] != -1) return -2; // Directory not empty
+
+    shrink_file(file_index, 0);
+    release_entry(file_index);
     return 0;
 }
 
-int bdfs_rename_file(const char* old_filename, const char* new_filename) {
+int bdfs_delete_file(const char* filename) {
+    fs_lock();
+    int result = delete_file_locked(filename);
+    fs_unlock();
+    return result;
+}
+
+static int rename_file_locked(const char* old_filename, const char* new_filename) {
     if (strlen(new_filename) >= BDFS_MAX_FILENAME_LENGTH) return -1;
 
     int old_file_index = find_entry_in_dir(old_filename, current_dir_inode);
@@ -138,37 +772,50 @@ int bdfs_rename_file(const char* old_filename, const char* new_filename) {
 
     if (find_entry_in_dir(new_filename, current_dir_inode) != -1) return -3;
 
+    index_remove(old_file_index);
     strcpy(file_table[old_file_index].name, new_filename);
-    bdfs_sync_file_table();
+    index_insert(old_file_index);
+    mark_entry_dirty(old_file_index);
     return 0;
 }
 
+int bdfs_rename_file(const char* old_filename, const char* new_filename) {
+    fs_lock();
+    int result = rename_file_locked(old_filename, new_filename);
+    fs_unlock();
+    return result;
+}
+
 void bdfs_list_files() {
     print("Listing for /", COLOR_SYSTEM);
     print(file_table[current_dir_inode].name, COLOR_SYSTEM);
     print(":\n", COLOR_SYSTEM);
 
-    for (int i = 0; i < BDFS_MAX_FILES; i++) {
-        if (file_table[i].name[0] != '\0' && file_table[i].parent_inode == current_dir_inode) {
-            if (file_table[i].type == BDFS_FILE_TYPE_DIRECTORY) {
-                uint8_t color = COLOR_DIR; // Default directory color
-                if (strcmp(file_table[i].name, "soul") == 0) color = COLOR_DIR_SOUL;
-                else if (strcmp(file_table[i].name, "cortex") == 0) color = COLOR_DIR_CORTEX;
-                else if (strcmp(file_table[i].name, "vault") == 0) color = COLOR_DIR_VAULT;
-                else if (strcmp(file_table[i].name, "chrome") == 0) color = COLOR_DIR_CHROME;
-                else if (strcmp(file_table[i].name, "drift") == 0) color = COLOR_DIR_DRIFT;
-                else if (strcmp(file_table[i].name, "ghost") == 0) color = COLOR_DIR_GHOST;
-                
-                print("d ", color);
-                print(file_table[i].name, color);
-                print("\n", color);
-            } else {
-                print("- ", COLOR_FILE);
-                print(file_table[i].name, COLOR_FILE);
-                print(" (", COLOR_GHOST);
-                print_int(file_table[i].length, COLOR_GHOST);
-                print(" bytes)\n", COLOR_GHOST);
+    for (int i = first_child[current_dir_inode]; i != -1; i = next_sibling[i]) {
+        if (file_table[i].type == BDFS_FILE_TYPE_DIRECTORY) {
+            uint8_t color = COLOR_DIR; // Default directory color
+            if (strcmp(file_table[i].name, "soul") == 0) color = COLOR_DIR_SOUL;
+            else if (strcmp(file_table[i].name, "cortex") == 0) color = COLOR_DIR_CORTEX;
+            else if (strcmp(file_table[i].name, "vault") == 0) color = COLOR_DIR_VAULT;
+            else if (strcmp(file_table[i].name, "chrome") == 0) color = COLOR_DIR_CHROME;
+            else if (strcmp(file_table[i].name, "drift") == 0) color = COLOR_DIR_DRIFT;
+            else if (strcmp(file_table[i].name, "ghost") == 0) color = COLOR_DIR_GHOST;
+            
+            print("d ", color);
+            print(file_table[i].name, color);
+            print("\n", color);
+        } else {
+            print("- ", COLOR_FILE);
+            print(file_table[i].name, COLOR_FILE);
+            print(" (", COLOR_GHOST);
+            print_int(file_table[i].length, COLOR_GHOST);
+            print(" bytes", COLOR_GHOST);
+            if (file_table[i].extent_count > 1) {
+                print(", ", COLOR_GHOST);
+                print_int(file_table[i].extent_count, COLOR_GHOST);
+                print(" extents", COLOR_GHOST);
             }
+            print(")\n", COLOR_GHOST);
         }
     }
 }
@@ -201,56 +848,68 @@ void bdfs_get_current_dir_name(char* buffer) {
     strcpy(buffer, file_table[current_dir_inode].name);
 }
 
-static uint32_t find_free_sector() {
-    uint32_t last_sector = 0; // Start from 0 for in-memory model
-    for (int i = 0; i < BDFS_MAX_FILES; i++) {
-        if (file_table[i].name[0] != '\0' && file_table[i].type == BDFS_FILE_TYPE_FILE) {
-            uint32_t file_end_sector = file_table[i].start_sector + (file_table[i].length + 511) / 512;
-            if (file_end_sector > last_sector) {
-                last_sector = file_end_sector;
+// Copy count bytes between buffer and the file at byte offset, one cached
+// sector at a time. The allocation must already cover the range.
+static int transfer_data(int index, uint32_t offset, uint8_t* buffer, uint32_t count, int write) {
+    uint32_t done = 0;
+    while (done < count) {
+        uint32_t pos = offset + done;
+        uint32_t in_sector = pos % BLOCKDEV_SECTOR_SIZE;
+        uint32_t chunk = BLOCKDEV_SECTOR_SIZE - in_sector;
+        if (chunk > count - done) {
+            chunk = count - done;
+        }
+        // A write that covers the sector up to the end of the data has
+        // nothing worth reading first
+        int whole = in_sector == 0 && (chunk == BLOCKDEV_SECTOR_SIZE || pos + chunk >= file_table[index].length);
+        uint32_t lba = file_lba(index, pos / BLOCKDEV_SECTOR_SIZE);
+        bcache_buf_t* buf = lba ? bcache_get(bdfs_dev, lba, write && whole ? BCACHE_NOREAD : 0) : 0;
+        if (buf == 0) {
+            return -1;
+        }
+        if (write) {
+            memcpy(buf->data + in_sector, buffer + done, chunk);
+            if (whole) {
+                memset(buf->data + chunk, 0, BLOCKDEV_SECTOR_SIZE - chunk);
             }
+            bcache_mark_dirty(buf);
+        } else {
+            memcpy(buffer + done, buf->data + in_sector, chunk);
         }
+        bcache_put(buf);
+        done += chunk;
     }
-    return last_sector;
+    return 0;
 }
 
-int bdfs_write_file(const char* filename, const uint8_t* buffer, uint32_t bytes_to_write) {
+// Replace the file's content. The allocation grows or shrinks to fit and
+// keeps the sectors it already had, so a rewrite stays in place.
+static int write_file_locked(const char* filename, const uint8_t* buffer, uint32_t bytes_to_write) {
     int file_index = find_entry_in_dir(filename, current_dir_inode);
     if (file_index == -1) return -1;
 
     bdfs_file_entry_t* file = &file_table[file_index];
     if (file->type != BDFS_FILE_TYPE_FILE) return -3;
 
-    uint32_t start_sector;
-    uint32_t needed_sectors = (bytes_to_write + 511) / 512;
-
-    if (file->length == 0) {
-        start_sector = find_free_sector();
-        // Check if there is enough space in our RAM disk for the new file.
-        if (start_sector + needed_sectors > BDFS_DATA_SECTORS) {
-            return -2; // Not enough space
-        }
-        file->start_sector = start_sector;
-    } else {
-        start_sector = file->start_sector;
-        uint32_t allocated_sectors = (file->length + 511) / 512;
-        if (needed_sectors > allocated_sectors) {
-            // This simple FS does not support reallocating/growing files.
-            return -2;
-        }
+    if (resize_file(file_index, (bytes_to_write + 511) / 512) < 0) {
+        return -2; // Not enough space
     }
-
     file->length = bytes_to_write;
-
-    // Write data to our in-memory storage.
-    uint32_t offset = start_sector * 512;
-    memcpy(&bdfs_storage[BDFS_FILE_TABLE_SECTORS * 512 + offset], buffer, bytes_to_write);
-
-    bdfs_sync_file_table();
+    if (transfer_data(file_index, 0, (uint8_t*)buffer, bytes_to_write, 1) < 0) {
+        return -4; // I/O error
+    }
+    mark_entry_dirty(file_index);
     return bytes_to_write;
 }
 
-int bdfs_read_file(const char* filename, uint8_t* buffer, uint32_t* bytes_read) {
+int bdfs_write_file(const char* filename, const uint8_t* buffer, uint32_t bytes_to_write) {
+    fs_lock();
+    int result = write_file_locked(filename, buffer, bytes_to_write);
+    fs_unlock();
+    return result;
+}
+
+static int read_file_locked(const char* filename, uint8_t* buffer, uint32_t* bytes_read) {
     int file_index = find_entry_in_dir(filename, current_dir_inode);
     if (file_index == -1) return -1;
 
@@ -259,10 +918,239 @@ int bdfs_read_file(const char* filename, uint8_t* buffer, uint32_t* bytes_read)
     bdfs_file_entry_t* file = &file_table[file_index];
     *bytes_read = file->length;
 
-    if (file->length > 0) {
-        uint32_t offset = (file->start_sector * 512);
-        memcpy(buffer, &bdfs_storage[BDFS_FILE_TABLE_SECTORS * 512 + offset], file->length);
+    if (transfer_data(file_index, 0, buffer, file->length, 0) < 0) {
+        return -3; // I/O error
+    }
+
+    return 0;
+}
+
+int bdfs_read_file(const char* filename, uint8_t* buffer, uint32_t* bytes_read) {
+    fs_lock();
+    int result = read_file_locked(filename, buffer, bytes_read);
+    fs_unlock();
+    return result;
+}
+
+void bdfs_get_space(uint32_t* free, uint32_t* largest_free_run) {
+    uint32_t start;
+    fs_lock();
+    *free = free_sectors;
+    *largest_free_run = used_map ? find_free_run(bdfs_data_sectors, &start) : 0;
+    fs_unlock();
+}
+
+// Move the file's data into the free run at start, as a single extent
+static int move_file(int index, uint32_t start) {
+    uint32_t total = file_sectors(index);
+    for (uint32_t n = 0; n < total; n++) {
+        if (copy_sectors(file_lba(index, n), BDFS_DATA_SECTOR_START + start + n, 1) < 0) {
+            return -1;
+        }
+    }
+
+    shrink_file(index, 0);
+    mark_sectors(start, total, 1);
+    extents[index][0].start = start;
+    extents[index][0].count = total;
+    file_table[index].extent_count = 1;
+    return 0;
+}
+
+static int is_file_with_data(int index) {
+    return file_table[index].name[0] != '\0' && file_table[index].type == BDFS_FILE_TYPE_FILE &&
+           file_table[index].extent_count > 0;
+}
+
+// Two passes: rewrite every fragmented file as one extent in the first free
+// run big enough, then slide the files, lowest first, down into the free
+// space before them so free space gathers into one run at the end.
+// Returns the number of files left fragmented (no free run big enough),
+// or -1 on I/O error.
+int bdfs_defrag(uint32_t* moved) {
+    int fragmented = 0;
+    *moved = 0;
+    fs_lock();
+    for (int i = 1; i < BDFS_MAX_FILES; i++) {
+        if (!is_file_with_data(i) || file_table[i].extent_count == 1) {
+            continue;
+        }
+        uint32_t start = 0;
+        if (find_free_run(file_sectors(i), &start) < file_sectors(i)) {
+            fragmented++;
+            continue;
+        }
+        if (move_file(i, start) < 0) {
+            fs_unlock();
+            return -1;
+        }
+        (*moved)++;
+    }
+
+    uint32_t done_below = 0; // Files starting below this are in place
+    for (;;) {
+        int next = -1;
+        for (int i = 1; i < BDFS_MAX_FILES; i++) {
+            if (is_file_with_data(i) && extents[i][0].start >= done_below &&
+                (next == -1 || extents[i][0].start < extents[next][0].start)) {
+                next = i;
+            }
+        }
+        if (next == -1) {
+            break;
+        }
+        done_below = extents[next][0].start + 1;
+        if (file_table[next].extent_count > 1) {
+            continue;
+        }
+
+        // Look for room with the file's own sectors counted as free. Any run
+        // found starts at or below it, and copying upwards from the bottom
+        // never overwrites a sector before it has been read.
+        bdfs_extent_t old = extents[next][0];
+        uint32_t start = old.start;
+        mark_sectors(old.start, old.count, 0);
+        find_free_run(old.count, &start);
+        mark_sectors(old.start, old.count, 1);
+        if (start < old.start) {
+            if (move_file(next, start) < 0) {
+                fs_unlock();
+                return -1;
+            }
+            (*moved)++;
+        }
+    }
+    fs_unlock();
+    return fragmented;
+}
+
+static bdfs_fd_t* get_fd(int fd) {
+    if (fd < 0 || fd >= BDFS_MAX_OPEN || open_files[fd].entry == -1) {
+        return 0;
+    }
+    return &open_files[fd];
+}
+
+static int open_locked(const char* filename, uint32_t flags) {
+    int slot = 0;
+    while (slot < BDFS_MAX_OPEN && open_files[slot].entry != -1) {
+        slot++;
     }
+    if (slot == BDFS_MAX_OPEN) return -4; // Too many open files
 
+    int file_index = find_entry_in_dir(filename, current_dir_inode);
+    if (file_index == -1) {
+        if (!(flags & BDFS_O_CREATE)) return -1;
+        int result = create_file_locked(filename);
+        if (result < 0) return result;
+        file_index = find_entry_in_dir(filename, current_dir_inode);
+    }
+    if (file_table[file_index].type != BDFS_FILE_TYPE_FILE) return -2;
+
+    if ((flags & BDFS_O_TRUNC) && (flags & BDFS_O_WRITE)) {
+        shrink_file(file_index, 0);
+        file_table[file_index].length = 0;
+    }
+    open_files[slot].entry = file_index;
+    open_files[slot].offset = 0;
+    open_files[slot].flags = flags;
+    open_count[file_index]++;
+    return slot;
+}
+
+// Returns a descriptor, or -1 if the file doesn't exist, -2 if it is a
+// directory, -4 if all descriptors are in use (or a bdfs_create_file error)
+int bdfs_open(const char* filename, uint32_t flags) {
+    fs_lock();
+    int result = open_locked(filename, flags);
+    fs_unlock();
+    return result;
+}
+
+// Returns the bytes read, 0 at end of file, or -1
+int bdfs_read(int fd, void* buffer, uint32_t count) {
+    fs_lock();
+    bdfs_fd_t* f = get_fd(fd);
+    if (f == 0 || !(f->flags & BDFS_O_READ)) {
+        fs_unlock();
+        return -1;
+    }
+    uint32_t length = file_table[f->entry].length;
+    uint32_t left = f->offset < length ? length - f->offset : 0;
+    if (count > left) {
+        count = left;
+    }
+    int result = -1;
+    if (transfer_data(f->entry, f->offset, buffer, count, 0) == 0) {
+        f->offset += count;
+        result = count;
+    }
+    fs_unlock();
+    return result;
+}
+
+// Returns the bytes written, or -1 (bad descriptor, disk full, I/O error)
+int bdfs_write(int fd, const void* buffer, uint32_t count) {
+    fs_lock();
+    bdfs_fd_t* f = get_fd(fd);
+    if (f == 0 || !(f->flags & BDFS_O_WRITE)) {
+        fs_unlock();
+        return -1;
+    }
+    bdfs_file_entry_t* file = &file_table[f->entry];
+    if (f->offset > file->length) {
+        f->offset = file->length; // Truncated behind our back
+    }
+    uint32_t end = f->offset + count;
+    if (end > file->length) {
+        if (resize_file(f->entry, (end + 511) / 512) < 0) {
+            fs_unlock();
+            return -1;
+        }
+        file->length = end;
+        mark_entry_dirty(f->entry);
+    }
+    int result = -1;
+    if (transfer_data(f->entry, f->offset, (uint8_t*)buffer, count, 1) == 0) {
+        f->offset = end;
+        result = count;
+    }
+    fs_unlock();
+    return result;
+}
+
+// Returns the new offset, or -1. The offset can't go past the end of the
+// file, so a file never has holes.
+int bdfs_lseek(int fd, int32_t offset, int whence) {
+    fs_lock();
+    bdfs_fd_t* f = get_fd(fd);
+    int result = -1;
+    if (f) {
+        int32_t base = 0;
+        if (whence == BDFS_SEEK_CUR) {
+            base = f->offset;
+        } else if (whence == BDFS_SEEK_END) {
+            base = file_table[f->entry].length;
+        }
+        int32_t target = base + offset;
+        if (target >= 0 && (uint32_t)target <= file_table[f->entry].length) {
+            f->offset = target;
+            result = target;
+        }
+    }
+    fs_unlock();
+    return result;
+}
+
+int bdfs_close(int fd) {
+    fs_lock();
+    bdfs_fd_t* f = get_fd(fd);
+    if (f == 0) {
+        fs_unlock();
+        return -1;
+    }
+    open_count[f->entry]--;
+    f->entry = -1;
+    fs_unlock();
     return 0;
-}
\ No newline at end of file
+}
@@ -2,22 +2,46 @@
 #define ATA_H
 
 #include "pmm.h"
+#include "blockdev.h"
 
-// ATA I/O Ports
-#define ATA_DATA_PORT         0x1F0
-#define ATA_ERROR_PORT        0x1F1
-#define ATA_SECTOR_COUNT_PORT 0x1F2
-#define ATA_LBA_LOW_PORT      0x1F3
-#define ATA_LBA_MID_PORT      0x1F4
-#define ATA_LBA_HIGH_PORT     0x1F5
-#define ATA_DRIVE_HEAD_PORT   0x1F6
-#define ATA_STATUS_CMD_PORT   0x1F7
-#define ATA_CONTROL_PORT      0x3F6
+// ATA register offsets from a channel's I/O base
+#define ATA_REG_DATA          0
+#define ATA_REG_ERROR         1
+#define ATA_REG_SECTOR_COUNT  2
+#define ATA_REG_LBA_LOW       3
+#define ATA_REG_LBA_MID       4
+#define ATA_REG_LBA_HIGH      5
+#define ATA_REG_DRIVE_HEAD    6
+#define ATA_REG_STATUS_CMD    7
+
+// Legacy channel resources
+#define ATA_PRIMARY_IO        0x1F0
+#define ATA_PRIMARY_CONTROL   0x3F6
+#define ATA_PRIMARY_IRQ       14
+#define ATA_SECONDARY_IO      0x170
+#define ATA_SECONDARY_CONTROL 0x376
+#define ATA_SECONDARY_IRQ     15
+
+#define ATA_CHANNELS          2
+#define ATA_DRIVES            4 // Primary master/slave, secondary master/slave
 
 // ATA Commands
-#define ATA_CMD_READ_SECTORS  0x20
-#define ATA_CMD_WRITE_SECTORS 0x30
-#define ATA_CMD_IDENTIFY      0xEC
+#define ATA_CMD_READ_SECTORS      0x20
+#define ATA_CMD_READ_SECTORS_EXT  0x24
+#define ATA_CMD_READ_DMA_EXT      0x25
+#define ATA_CMD_READ_MULTIPLE_EXT 0x29
+#define ATA_CMD_WRITE_SECTORS     0x30
+#define ATA_CMD_WRITE_SECTORS_EXT 0x34
+#define ATA_CMD_WRITE_DMA_EXT     0x35
+#define ATA_CMD_WRITE_MULTIPLE_EXT 0x39
+#define ATA_CMD_READ_MULTIPLE     0xC4
+#define ATA_CMD_WRITE_MULTIPLE    0xC5
+#define ATA_CMD_SET_MULTIPLE      0xC6
+#define ATA_CMD_READ_DMA          0xC8
+#define ATA_CMD_WRITE_DMA         0xCA
+#define ATA_CMD_CACHE_FLUSH       0xE7
+#define ATA_CMD_CACHE_FLUSH_EXT   0xEA
+#define ATA_CMD_IDENTIFY          0xEC
 
 // ATA Status Bits
 #define ATA_SR_BSY  0x80    // Busy
@@ -29,9 +53,52 @@
 #define ATA_SR_IDX  0x02    // Index
 #define ATA_SR_ERR  0x01    // Error
 
+#define ATA_LBA28_LIMIT     0x10000000 // Sectors reachable without LBA48
+#define ATA_MAX_REQUEST     256        // Sectors per command
+
+// PCI IDE bus master registers, relative to BAR4 (+8 for the secondary channel)
+#define ATA_BM_COMMAND      0x0
+#define ATA_BM_STATUS       0x2
+#define ATA_BM_PRDT         0x4
+#define ATA_BM_CMD_START    0x01
+#define ATA_BM_CMD_READ     0x08 // Device to memory
+#define ATA_BM_SR_ACTIVE    0x01
+#define ATA_BM_SR_ERR       0x02
+#define ATA_BM_SR_IRQ       0x04
+#define ATA_PRD_MAX         64   // Enough for 256 unaligned, scattered sectors
+#define ATA_PRD_EOT         0x8000
+
+typedef struct {
+    uint32_t reads;
+    uint32_t writes;
+    uint32_t sectors_read;
+    uint32_t sectors_written;
+    uint32_t irqs;
+    uint32_t spurious_irqs;
+    uint32_t errors;
+    uint32_t flushes;
+    uint32_t dma_requests;
+    uint32_t pio_fallbacks;     // Requests the bus master couldn't take
+    uint32_t queue_peak;
+} ata_stats_t;
+
+// What IDENTIFY reported for one drive position
+typedef struct {
+    uint8_t  present;
+    uint8_t  channel;
+    uint8_t  slave;
+    uint8_t  lba48;
+    uint8_t  dma;               // Drive supports DMA
+    uint32_t multiple;          // Sectors per DRQ block, 1 = plain READ/WRITE SECTORS
+    uint32_t sectors;
+    char     model[41];
+    blockdev_t* dev;
+    ata_stats_t stats;
+} ata_drive_t;
+
 void ata_init();
-int  ata_read_sector(uint32_t lba, void* buffer);
-int  ata_write_sector(uint32_t lba, const void* buffer);
-int  ata_status();
+void ata_dma_init(uint8_t bus, uint8_t dev, uint8_t func);
+int  ata_dma_enabled(uint32_t channel);
+const ata_drive_t* ata_get_drive(uint32_t index);
 
-#endif // ATA_H
\ No newline at end of file
+#endif // ATA_H
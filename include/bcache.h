@@ -0,0 +1,52 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include "pmm.h"
+#include "blockdev.h"
+
+#define BCACHE_BLOCKS       256     // Cached sectors (128KB)
+#define BCACHE_HASH_BUCKETS 64
+#define BCACHE_COALESCE     32      // Sectors per write-back request
+#define BCACHE_SYNC_INTERVAL_US 5000000
+
+// bcache_get flags
+#define BCACHE_NOREAD 0x1 // The caller overwrites the whole sector
+
+typedef struct bcache_buf {
+    blockdev_t* dev;            // 0 while the slot is unused
+    uint32_t lba;
+    uint8_t* data;              // BLOCKDEV_SECTOR_SIZE bytes
+    uint8_t  dirty;
+    uint8_t  write_failed;      // Last write-back failed; not picked for eviction
+    uint32_t pins;
+    struct bcache_buf* hash_next;
+    struct bcache_buf* lru_prev; // Towards the most recently used end
+    struct bcache_buf* lru_next;
+} bcache_buf_t;
+
+typedef struct {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+    uint32_t dirty_evictions;   // Evictions that had to write the sector first
+    uint32_t syncs;
+    uint32_t writeback_requests;
+    uint32_t writeback_sectors;
+    uint32_t dirty;             // Dirty buffers right now
+} bcache_stats_t;
+
+void bcache_init();
+
+// Returns the pinned buffer for (dev, lba), reading it on a miss unless
+// BCACHE_NOREAD is given. 0 on I/O error or if every buffer is pinned.
+bcache_buf_t* bcache_get(blockdev_t* dev, uint32_t lba, uint32_t flags);
+void bcache_put(bcache_buf_t* buf);
+void bcache_mark_dirty(bcache_buf_t* buf);
+
+// Write back every dirty buffer of dev, retrying ones that failed before,
+// then flush the drive's cache
+int bcache_sync(blockdev_t* dev);
+
+const bcache_stats_t* bcache_get_stats();
+
+#endif
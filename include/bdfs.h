@@ -4,10 +4,35 @@
 #include "pmm.h"
 
 #define BDFS_MAGIC 0x42444653 // "BDFS"
+#define BDFS_VERSION 2
 #define BDFS_MAX_FILES 64
 #define BDFS_MAX_FILENAME_LENGTH 16
+#define BDFS_HASH_BUCKETS 128 // Directory index, a power of two
+#define BDFS_MAX_EXTENTS 8    // Contiguous runs per file
+#define BDFS_MAX_OPEN 16      // File descriptors
+
+// bdfs_open flags
+#define BDFS_O_READ   0x1
+#define BDFS_O_WRITE  0x2
+#define BDFS_O_CREATE 0x4 // Create the file if it doesn't exist
+#define BDFS_O_TRUNC  0x8 // Start with an empty file
+
+// bdfs_lseek whence
+#define BDFS_SEEK_SET 0
+#define BDFS_SEEK_CUR 1
+#define BDFS_SEEK_END 2
+
+// On-disk layout, in sectors from the start of the device
+#define BDFS_SUPERBLOCK_SECTOR 0
+#define BDFS_FILE_TABLE_START 1
 #define BDFS_FILE_TABLE_SECTORS 4
-#define BDFS_DATA_SECTOR_START BDFS_FILE_TABLE_SECTORS
+#define BDFS_EXTENT_TABLE_START (BDFS_FILE_TABLE_START + BDFS_FILE_TABLE_SECTORS)
+#define BDFS_EXTENT_TABLE_SECTORS 8
+#define BDFS_DATA_SECTOR_START (BDFS_EXTENT_TABLE_START + BDFS_EXTENT_TABLE_SECTORS)
+
+#define BDFS_DEVICE "hdb"            // Disk BDFS lives on
+// Fallback RAM disk when that disk is missing (4MB of data)
+#define BDFS_RAMDISK_SECTORS (BDFS_DATA_SECTOR_START + 8192)
 
 // Represents a file in the BDFS
 typedef enum {
@@ -19,13 +44,45 @@ typedef struct {
     char name[BDFS_MAX_FILENAME_LENGTH];
     bdfs_file_type_t type;
     uint32_t parent_inode;
-    uint32_t start_sector;
+    uint32_t extent_count; // Extents in use, 0 for directories and empty files
     uint32_t length; // Length in bytes for files, number of entries for directories
 } bdfs_file_entry_t;
 
+#define BDFS_ENTRIES_PER_SECTOR (512 / sizeof(bdfs_file_entry_t))
+
+// A run of data sectors, numbered from the start of the data area.
+// Each file has BDFS_MAX_EXTENTS of them in the extent table, at the same
+// index as its file table entry.
+typedef struct {
+    uint32_t start;
+    uint32_t count;
+} bdfs_extent_t;
+
+#define BDFS_FILES_PER_EXTENT_SECTOR (512 / (BDFS_MAX_EXTENTS * sizeof(bdfs_extent_t)))
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t total_sectors;
+    uint32_t table_start;
+    uint32_t table_sectors;
+    uint32_t extent_table_start;
+    uint32_t extent_table_sectors;
+    uint32_t data_start;
+} bdfs_superblock_t;
+
 // Function prototypes
 void bdfs_init();
 void bdfs_sync_file_table();
+int bdfs_sync();
+const char* bdfs_get_device_name();
+void bdfs_get_space(uint32_t* free_sectors, uint32_t* largest_free_run);
+int bdfs_defrag(uint32_t* moved);
+
+// Erase a block device and mount a new, empty filesystem on it. Returns -1
+// if there is no such device, -2 while files are open, -3 if the device is
+// too small or the bitmap can't be allocated, -4 on I/O error.
+int bdfs_format_device(const char* name);
 
 // File operations
 int bdfs_create_file(const char* filename);
@@ -35,6 +92,13 @@ void bdfs_list_files();
 int bdfs_read_file(const char* filename, uint8_t* buffer, uint32_t* bytes_read);
 int bdfs_write_file(const char* filename, const uint8_t* buffer, uint32_t bytes_to_write);
 
+// File descriptors. Each has its own offset; read and write move it.
+int bdfs_open(const char* filename, uint32_t flags);
+int bdfs_read(int fd, void* buffer, uint32_t count);
+int bdfs_write(int fd, const void* buffer, uint32_t count);
+int bdfs_lseek(int fd, int32_t offset, int whence);
+int bdfs_close(int fd);
+
 // Directory operations
 int bdfs_mkdir(const char* dirname);
 int bdfs_chdir(const char* dirname);
@@ -0,0 +1,62 @@
+#ifndef BLOCKDEV_H
+#define BLOCKDEV_H
+
+#include "types.h"
+
+#define BLOCKDEV_MAX         8
+#define BLOCKDEV_SECTOR_SIZE 512
+
+// Request status
+#define BLK_REQ_DONE     0
+#define BLK_REQ_PENDING  1
+#define BLK_REQ_ERROR   -1
+
+struct blockdev;
+
+// One queued transfer of `count` consecutive sectors (1..max_request).
+// With flush set the device's write cache is flushed afterwards; a flush
+// request with count 0 is a pure barrier. The caller owns the request and
+// the buffer until it completes; done (if set) is then called with
+// interrupts off, normally from the device's IRQ handler.
+typedef struct blk_request {
+    uint32_t lba;
+    uint8_t* buffer;
+    uint16_t count;
+    uint8_t  write;
+    uint8_t  flush;
+    volatile int status;
+    void (*done)(struct blk_request* req);
+    void* arg;
+    struct blockdev* dev;       // Set by blk_submit()
+    uint16_t transferred;       // Sectors moved so far (driver private)
+    uint8_t  dma;               // Driver private
+    struct blk_request* next;   // Queue link (driver private)
+} blk_request_t;
+
+typedef struct blockdev {
+    char name[8];
+    uint32_t sectors;
+    uint32_t max_request;       // Sectors per request
+    void* driver_data;
+    void (*submit)(struct blockdev* dev, blk_request_t* req);
+    // Advance outstanding requests by polling, while interrupts are off
+    void (*poll)(struct blockdev* dev);
+} blockdev_t;
+
+blockdev_t* blockdev_register(const char* name, uint32_t sectors, uint32_t max_request,
+                              void (*submit)(blockdev_t*, blk_request_t*),
+                              void (*poll)(blockdev_t*), void* driver_data);
+uint32_t blockdev_count();
+blockdev_t* blockdev_get(uint32_t index);
+blockdev_t* blockdev_find(const char* name);
+
+// Asynchronous interface
+void blk_submit(blockdev_t* dev, blk_request_t* req);
+int  blk_wait(blk_request_t* req);
+
+// Synchronous helpers, split into max_request-sized requests
+int blk_read(blockdev_t* dev, uint32_t lba, uint32_t count, void* buffer);
+int blk_write(blockdev_t* dev, uint32_t lba, uint32_t count, const void* buffer);
+int blk_flush(blockdev_t* dev);
+
+#endif
@@ -1,8 +1,55 @@
 #ifndef CPU_H
 #define CPU_H
 
+#include "types.h"
+
+// What the CPU is spending cycles on. IRQ time is kept per line.
+#define CPU_CTX_KERNEL  0 // Threads doing work
+#define CPU_CTX_IDLE    1 // Halted in cpu_idle()
+#define CPU_CTX_IRQ(n)  (2 + (n))
+#define CPU_CONTEXTS    18
+
+#define CPU_HISTORY     60 // One sample per second
+
 void cpu_init();
 void cpu_idle();
 int cpu_get_usage();
+void cpu_tick();
+
+// Charge the cycles since the last switch to the current context and move
+// to ctx. Returns the previous context for cpu_context_exit().
+int cpu_context_enter(int ctx);
+void cpu_context_exit(int prev);
+
+// Percent of time spent in ctx, averaged over the last `seconds` samples
+int cpu_get_average(int ctx, uint32_t seconds);
+// Busy percentage per second, oldest first. Returns the number of samples.
+uint32_t cpu_get_history(uint8_t* busy, uint32_t max);
+
+static inline uint64_t rdtsc() {
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// Short critical sections against IRQ handlers and preemption: disable
+// interrupts and hand back the previous EFLAGS for irq_restore().
+static inline unsigned int irq_save() {
+    unsigned int flags;
+    asm volatile("pushf; pop %0; cli" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+static inline int irq_enabled() {
+    unsigned int flags;
+    asm volatile("pushf; pop %0" : "=r"(flags));
+    return (flags & 0x200) != 0;
+}
+
+static inline void irq_restore(unsigned int flags) {
+    if (flags & 0x200) {
+        asm volatile("sti" ::: "memory");
+    }
+}
 
-#endif
\ No newline at end of file
+#endif
@@ -9,5 +9,6 @@
 void* kmalloc(uint32_t size);
 void* alloc_aligned(uint32_t size, uint32_t alignment);
 void kfree(void* ptr);
+uint32_t heap_get_usage();
 
 #endif
\ No newline at end of file
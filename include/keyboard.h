@@ -8,5 +8,6 @@ extern unsigned char kbd_us[128];
 
 void keyboard_install();
 char keyboard_get_char();
+int keyboard_has_char();
 char keyboard_get_char_blocking();
 unsigned char keyboard_get_scancode();
@@ -0,0 +1,26 @@
+#ifndef KLOG_H
+#define KLOG_H
+
+#include "include/types.h"
+
+// Kernel log ring (dmesg). Safe to call from IRQ handlers: appending never
+// blocks and never touches the screen. Entries reach the console when
+// klog_drain() runs from the shell's idle loop. It is single-consumer: only
+// the shell thread may call it.
+#define KLOG_ENTRIES  256
+#define KLOG_TAG_LEN  8
+#define KLOG_MSG_LEN  112
+
+typedef struct {
+    volatile uint32_t seq; // index + 1 once committed, 0 while being written
+    uint32_t ticks;
+    char tag[KLOG_TAG_LEN];
+    char msg[KLOG_MSG_LEN];
+} klog_entry_t;
+
+void klog(const char* tag, const char* fmt, ...);
+void log(const char* tag, const char* msg);
+void klog_drain();
+void klog_dump();
+
+#endif
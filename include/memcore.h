@@ -5,6 +5,12 @@
 
 #include "include/types.h"
 
+typedef char* va_list;
+
+#define va_start(ap, last_arg) (ap = (char*)(&last_arg + 1))
+#define va_arg(ap, type)       (*(type*)((ap += sizeof(type)) - sizeof(type)))
+#define va_end(ap)             (ap = 0)
+
 void* memcpy(void* dest, const void* src, unsigned int count);
 void* memmove(void* dest, const void* src, unsigned int count);
 void* memset(void* dest, int value, unsigned int count);
@@ -26,12 +32,13 @@ void print_char(char c, unsigned char color);
 void println(const char* msg, unsigned char color);
 void kprintf(const char* fmt, ...);
 int snprintf(char* str, unsigned int size, const char* format, ...);
+int vsnprintf(char* str, unsigned int size, const char* format, va_list args);
 void print_char_at(char c, unsigned char color, int x, int y);
 void set_cursor(int x, int y);
 
 void panic(const char* msg);
-void log(const char* tag, const char* msg);
 void scroll_up();
 void scroll_down();
 void update_cursor();
+void console_flush();
 #endif
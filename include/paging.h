@@ -7,19 +7,34 @@
 #define PDE_PRESENT  0x1
 #define PDE_RW       0x2
 #define PDE_USER     0x4
+#define PDE_LARGE    0x80 // 4MB page (needs CR4.PSE)
 
 // Page Table Entry flags
 #define PTE_PRESENT  0x1
 #define PTE_RW       0x2
 #define PTE_USER     0x4
+#define PTE_WRITE_THROUGH 0x8
+#define PTE_CACHE_DISABLE 0x10 // For MMIO
+#define PTE_COW      0x200 // Shared read-only until written (software bit)
+
+#define LARGE_PAGE_SIZE 0x400000
+
+// Per-address-space user half. Everything outside it (identity map, heap,
+// VMA window, MMIO) is the kernel half, shared by all address spaces.
+#define USER_SPACE_START 0x40000000
+#define USER_SPACE_END   0xC0000000
 
 typedef struct {
     uint32_t present    : 1;
     uint32_t rw         : 1;
     uint32_t user       : 1;
+    uint32_t write_thru : 1;
+    uint32_t cache_dis  : 1;
     uint32_t accessed   : 1;
     uint32_t dirty      : 1;
-    uint32_t unused     : 7;
+    uint32_t unused     : 2;
+    uint32_t cow        : 1; // Available bit 9: copy-on-write
+    uint32_t avail      : 2;
     uint32_t frame      : 20;
 } page_table_entry_t;
 
@@ -34,17 +49,54 @@ typedef struct {
     uint32_t write_thru : 1;
     uint32_t cache_dis  : 1;
     uint32_t accessed   : 1;
-    uint32_t unused     : 6;
-    uint32_t frame      : 20;
+    uint32_t dirty      : 1; // 4MB pages only
+    uint32_t large      : 1; // Maps a 4MB page instead of a page table
+    uint32_t unused     : 4;
+    uint32_t frame      : 20; // For 4MB pages only bits 10-19 are used
 } page_directory_entry_t;
 
 typedef struct {
     page_directory_entry_t tables[1024];
 } page_directory_t;
 
+// TLB flush accounting, per PAGE_OWNER_* subsystem
+typedef struct {
+    uint32_t pages;        // map/unmap operations
+    uint32_t batches;      // Committed batches
+    uint32_t invlpg;       // Single-page invalidations
+    uint32_t full_flushes; // CR3 reloads
+} paging_stats_t;
+
+typedef struct {
+    uint32_t pd_phys;           // Physical address of the page directory
+    uint32_t kernel_generation; // Kernel PDE version last copied in
+} address_space_t;
+
 void paging_install();
 void map_page(uint32_t phys_addr, uint32_t virt_addr, uint32_t flags);
 void unmap_page(uint32_t virt_addr);
+// Uses 4MB pages where it can, except in [USER_SPACE_START, USER_SPACE_END),
+// which is only ever mapped with 4KB pages
+void map_range(uint32_t phys_addr, uint32_t virt_addr, uint32_t size, uint32_t flags);
+
+// Between begin and commit, map/unmap only record which TLB entries are
+// stale; commit invalidates them in one go. Pages that were unmapped or
+// remapped must not be touched until then. Batches nest, and the work of
+// inner batches is charged to the outermost owner.
+void paging_batch_begin(uint8_t owner);
+void paging_batch_commit();
+const paging_stats_t* paging_get_stats(uint8_t owner);
+
+// Address spaces. paging_clone_address_space() clones the current one with
+// copy-on-write; the current space can't be destroyed.
+address_space_t* paging_create_address_space();
+address_space_t* paging_clone_address_space();
+void paging_destroy_address_space(address_space_t* space);
+void paging_switch(address_space_t* space);
+address_space_t* paging_current_address_space();
+address_space_t* paging_kernel_address_space();
+int paging_handle_cow(uint32_t virt_addr, uint32_t err_code);
+int paging_cow_check();
 uint32_t get_phys_addr(uint32_t virt_addr);
 
 #endif
\ No newline at end of file
@@ -3,5 +3,6 @@
 #include <include/types.h>
 
 uint32_t pci_config_read(uint8_t bus, uint8_t device, uint8_t func, uint8_t offset);
+void pci_config_write(uint8_t bus, uint8_t device, uint8_t func, uint8_t offset, uint32_t value);
 void pci_scan_all();
 void pci_list_devices();
\ No newline at end of file
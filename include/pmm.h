@@ -15,12 +15,57 @@ typedef struct {
     uint32_t type;
 } __attribute__((packed)) e820_entry_t;
 
+// Page frame database: one entry per physical frame, indexed by frame number
+#define PAGE_FREE     0x01 // Heads a block on a buddy free list
+#define PAGE_RESERVED 0x02 // Kernel image or PMM metadata, never freed
+
+// Who a frame was allocated for (meminfo -v)
+#define PAGE_OWNER_NONE       0
+#define PAGE_OWNER_KERNEL     1
+#define PAGE_OWNER_HEAP       2
+#define PAGE_OWNER_PAGE_TABLE 3
+#define PAGE_OWNER_NIC        4
+#define PAGE_OWNER_FS_CACHE   5
+#define PAGE_OWNER_COUNT      6
+
+typedef struct page {
+    union {
+        struct {             // While free: buddy list links (frame numbers)
+            uint32_t next;
+            uint32_t prev;
+        };
+        struct {             // While allocated
+            uint16_t refcount;
+            uint8_t  owner;
+        };
+    };
+    uint8_t order;           // Order of the buddy block this frame heads
+    uint8_t flags;
+} __attribute__((packed)) page_t;
+
+// Largest buddy block is 2^PMM_MAX_ORDER frames (4MB)
+#define PMM_MAX_ORDER 10
+
 // PMM API
 void pmm_init(uint32_t mmap_addr, uint32_t mmap_entries);
 void* pmm_alloc_block();
+void* pmm_alloc_blocks(uint32_t count, uint32_t align);
 void pmm_free_block(void* block);
+void pmm_free_blocks(void* block, uint32_t count);
+void* pmm_alloc_order(uint32_t order);
+void pmm_free_order(void* block, uint32_t order);
 uint32_t pmm_get_total_memory();
 uint32_t pmm_get_used_memory();
 uint32_t pmm_get_free_memory();
+uint32_t pmm_get_free_list_depth(uint32_t order);
+
+// Frame sharing. A frame starts with one reference; pmm_put() frees it
+// when the last one is dropped. pmm_free_block() is pmm_put().
+page_t* pmm_page(void* block);
+void pmm_get(void* block);
+void pmm_put(void* block);
+void pmm_set_owner(void* block, uint32_t count, uint8_t owner);
+uint32_t pmm_get_owner_blocks(uint8_t owner);
+uint32_t pmm_get_memory_map(const e820_entry_t** map);
 
 #endif
\ No newline at end of file
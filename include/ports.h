@@ -28,6 +28,15 @@ static inline void outw(unsigned short port, unsigned short data) {
                    :
                    : "a"(data), "Nd"(port) );
 }
+// Block transfers of `count` 16-bit words
+static inline void insw(uint16_t port, void* buffer, uint32_t count) {
+    asm volatile ("rep insw" : "+D"(buffer), "+c"(count) : "d"(port) : "memory");
+}
+
+static inline void outsw(uint16_t port, const void* buffer, uint32_t count) {
+    asm volatile ("rep outsw" : "+S"(buffer), "+c"(count) : "d"(port) : "memory");
+}
+
 static inline void outl(uint16_t port, uint32_t val) {
     __asm__ volatile ("outl %0, %1" : : "a"(val), "Nd"(port));
 }
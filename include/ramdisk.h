@@ -0,0 +1,9 @@
+#ifndef RAMDISK_H
+#define RAMDISK_H
+
+#include "blockdev.h"
+
+// A demand-paged block device in RAM. Returns 0 if the area can't be reserved.
+blockdev_t* ramdisk_create(const char* name, uint32_t sectors);
+
+#endif
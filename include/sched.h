@@ -0,0 +1,62 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include "pmm.h"
+#include "regs.h"
+#include "paging.h"
+
+#define SCHED_MAX_THREADS 16
+#define SCHED_STACK_SIZE  8192
+#define SCHED_QUANTUM     2 // Timer ticks before a thread is preempted
+#define SCHED_YIELD_VECTOR 0x30
+
+// Priorities, lower runs first
+#define SCHED_PRIORITY_HIGH   0
+#define SCHED_PRIORITY_NORMAL 1
+#define SCHED_PRIORITY_LOW    2
+#define SCHED_PRIORITIES      3
+
+typedef enum {
+    THREAD_UNUSED,
+    THREAD_READY,
+    THREAD_RUNNING,
+    THREAD_SLEEPING,
+    THREAD_DEAD
+} thread_state_t;
+
+typedef struct thread {
+    uint32_t esp;             // Saved regs_t frame while switched out
+    uint32_t id;
+    char name[16];
+    thread_state_t state;
+    uint8_t priority;
+    uint32_t cpu_ticks;       // Timer ticks spent running
+    void* stack;              // 0 for the boot thread
+    address_space_t* space;   // Restored when the thread is switched in
+    struct thread* next;      // Run queue link
+} thread_t;
+
+// Threads blocked until someone calls sched_wake_all(), linked through next
+typedef struct {
+    thread_t* head;
+} wait_queue_t;
+
+void sched_init();
+int thread_create(const char* name, void (*entry)(void*), void* arg, uint8_t priority);
+void thread_exit();
+void sched_yield();
+void sched_sleep(uint32_t ticks);
+void sched_sleep_us(uint32_t us);
+int sched_others_ready();
+int sched_idle_wait();
+void sched_wait(wait_queue_t* wq);
+void sched_wake_all(wait_queue_t* wq);
+thread_t* sched_current();
+uint32_t sched_get_threads(const thread_t** threads);
+
+// Called from the interrupt path
+void sched_tick();
+void sched_irq_wakeup();
+regs_t* sched_preempt(regs_t* frame);
+
+#endif
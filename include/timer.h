@@ -4,5 +4,26 @@
 #include "pmm.h"
 extern uint32_t timer_ticks; // Declare timer_ticks as external
 
+#define TIMER_HZ         100
+#define TIMER_TICK_NS    10000000 // One scheduler tick
+#define TIMER_MAX_EVENTS 32
+
 void timer_install();
-void timer_handler(regs_t *r);
\ No newline at end of file
+void timer_handler(regs_t *r);
+
+// Nanoseconds since timer_install(), from the TSC when the CPU has one
+uint64_t ktime_ns();
+uint32_t timer_get_tsc_khz(); // 0 if ktime_ns() only has tick resolution
+
+// One-shot deadlines. fn runs with interrupts off, normally from the timer IRQ.
+// timer_add() returns an id for timer_cancel(), or -1 if the queue is full.
+int timer_add(uint64_t deadline_ns, void (*fn)(void*), void* arg);
+void timer_cancel(int id);
+
+// Busy-wait, for short driver polling delays
+void udelay(uint32_t us);
+
+// Bracket a halt: while idle the PIT is only armed for the next deadline,
+// not for every scheduler tick.
+void timer_idle_enter();
+void timer_idle_exit();
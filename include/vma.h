@@ -0,0 +1,32 @@
+#ifndef VMA_H
+#define VMA_H
+
+#include "pmm.h"
+
+// Demand-paged kernel regions live in this window. Nothing else maps here.
+#define VMA_WINDOW_START 0x10000000
+#define VMA_WINDOW_END   0x40000000
+#define VMA_MAX_AREAS    32
+
+// Area flags
+#define VMA_WRITE 0x1
+#define VMA_USER  0x2
+
+// A reserved virtual range. Its pages get a zeroed frame on first touch.
+typedef struct {
+    uint32_t start;
+    uint32_t end;      // Exclusive
+    uint32_t flags;
+    uint8_t  owner;    // PAGE_OWNER_* tag for the frames behind it
+    uint32_t resident; // Pages backed so far
+    uint32_t faults;
+    const char* name;
+} vma_t;
+
+void* vma_alloc(uint32_t size, uint32_t flags, uint8_t owner, const char* name);
+int vma_free(void* start);
+vma_t* vma_find(uint32_t addr);
+int vma_handle_fault(uint32_t addr, uint32_t err_code);
+uint32_t vma_get_areas(const vma_t** areas);
+
+#endif
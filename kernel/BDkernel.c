@@ -17,9 +17,14 @@ extern char _stack_end;
 #include "include/ata.h"
 #include "include/pci.h"
 #include "include/cpu.h"
+#include "include/klog.h"
+#include "include/sched.h"
 
 // Define the RAM disk base address
 #define RAMDISK_BASE 0x200000
+
+static void pci_scan_thread(void* arg);
+
 void kernel_main() {
     // Read memory map info from the bootloader-populated addresses
     uint32_t mmap_entries = *(uint32_t*)0x900;
@@ -52,8 +57,11 @@ void kernel_main() {
     // Initialize paging
     paging_install();
     print("INFO: Paging enabled\n", 0x02);
+    if (paging_cow_check() == -1) {
+        print("ERROR: Copy-on-write check failed\n", 0x04);
+    }
 
-    // Heap is initialized by global heap_ptr in memory/heap.c
+    // Heap pages are mapped on demand by memory/heap.c
     print("INFO: Kernel Heap initialized\n", 0x02);
 
     // void* test1 = kmalloc(16);
@@ -61,9 +69,9 @@ void kernel_main() {
     // void* test3 = kmalloc(8);
 
     // kprintf("Heap allocations:\n");
-    // kprintf("  test1 = %x\n", test1);
-    // kprintf("  test2 = %x\n", test2);
-    // kprintf("  test3 = %x\n", test3);
+    // kprintf("  test1 = %p\n", test1);
+    // kprintf("  test2 = %p\n", test2);
+    // kprintf("  test3 = %p\n", test3);
 
 
     // Initialize timer
@@ -74,19 +82,25 @@ void kernel_main() {
     keyboard_install();
     print("INFO: Keyboard installed\n", 0x02);
 
+    // Turn this context into the first kernel thread
+    sched_init();
+    print("INFO: Scheduler started\n", 0x02);
+
     // Initialize ATA driver
     ata_init();
+    klog_drain();
 
     // Initialize BDFS
     bdfs_init();
+    klog_drain();
     print("INFO: BDFS initialized\n", 0x02);
 
     // Enable interrupts
     asm volatile ("sti");
 
 
-    // Scan for PCI devices
-    pci_scan_all();
+    // Scan for PCI devices in the background so the shell comes up at once
+    thread_create("pci", pci_scan_thread, 0, SCHED_PRIORITY_NORMAL);
 
     // Initialize CPU usage monitoring
     cpu_init();
@@ -97,3 +111,9 @@ void kernel_main() {
     // Wait for interrupts (should not be reached if shell loops indefinitely)
     for(;;);
 }
+
+// What the scan logs shows up through the shell, the only thread that
+// drains the log
+static void pci_scan_thread(void* arg) {
+    pci_scan_all();
+}
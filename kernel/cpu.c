@@ -1,26 +1,139 @@
 #include "include/cpu.h"
 #include "include/timer.h"
+#include "include/sched.h"
 
-static uint32_t idle_ticks = 0;
-static uint32_t total_ticks = 0;
+// Every cycle is charged to exactly one context: the IRQ stubs, cpu_idle()
+// and everything else switch between them. Once a second the split is
+// turned into percentages and kept in a ring for the last minute.
+static int accounting = 0;
+static int current_ctx = CPU_CTX_KERNEL;
+static uint64_t last_stamp = 0;
+static uint64_t ctx_cycles[CPU_CONTEXTS];   // Since boot
+static uint64_t sample_start[CPU_CONTEXTS]; // ctx_cycles when this sample began
+static uint32_t sample_ticks = 0;
+
+static uint8_t history[CPU_HISTORY][CPU_CONTEXTS];
+static uint32_t history_head = 0; // Next slot to write
+static uint32_t history_count = 0;
+
+// TSC cycles, or nanoseconds at tick resolution on CPUs without a TSC
+static uint64_t cpu_clock() {
+    return timer_get_tsc_khz() ? rdtsc() : ktime_ns();
+}
+
+static void charge() {
+    uint64_t now = cpu_clock();
+    ctx_cycles[current_ctx] += now - last_stamp;
+    last_stamp = now;
+}
 
 void cpu_init() {
-    // Nothing to do here for now bitch
+    last_stamp = cpu_clock();
+    accounting = 1;
+}
+
+int cpu_context_enter(int ctx) {
+    unsigned int flags = irq_save();
+    if (accounting) {
+        charge();
+    }
+    int prev = current_ctx;
+    current_ctx = ctx;
+    irq_restore(flags);
+    return prev;
+}
+
+void cpu_context_exit(int prev) {
+    cpu_context_enter(prev);
 }
 
 void cpu_idle() {
-    asm volatile("sti");
-    asm volatile("hlt");
-    idle_ticks++;
+    // Let other threads run rather than halting: the scheduler either
+    // yields to an equal or better one or blocks us until the next IRQ
+    asm volatile("cli");
+    if (sched_idle_wait()) {
+        asm volatile("sti");
+        return;
+    }
+
+    // Stay halted until the next timer deadline or device IRQ, not just
+    // the next tick. sti only takes effect after hlt, so no wakeup is lost.
+    int prev = cpu_context_enter(CPU_CTX_IDLE);
+    timer_idle_enter();
+    asm volatile("sti; hlt");
+    timer_idle_exit();
+    cpu_context_exit(prev);
+}
+
+// Close the current one-second sample
+static void sample() {
+    charge();
+
+    uint64_t delta[CPU_CONTEXTS];
+    uint64_t total = 0;
+    for (int i = 0; i < CPU_CONTEXTS; i++) {
+        delta[i] = ctx_cycles[i] - sample_start[i];
+        sample_start[i] = ctx_cycles[i];
+        total += delta[i];
+    }
+
+    // Scale down so that the percentages only need 32-bit arithmetic
+    uint32_t shift = 0;
+    while ((total >> shift) >= (1u << 24)) {
+        shift++;
+    }
+    uint32_t scaled_total = (uint32_t)(total >> shift);
+    if (scaled_total == 0) {
+        return;
+    }
+
+    uint8_t* slot = history[history_head];
+    for (int i = 0; i < CPU_CONTEXTS; i++) {
+        slot[i] = (uint8_t)((uint32_t)(delta[i] >> shift) * 100 / scaled_total);
+    }
+    history_head = (history_head + 1) % CPU_HISTORY;
+    if (history_count < CPU_HISTORY) {
+        history_count++;
+    }
+}
+
+void cpu_tick() {
+    if (accounting && ++sample_ticks == TIMER_HZ) {
+        sample_ticks = 0;
+        sample();
+    }
+}
+
+// Sample `age` seconds back, 0 being the newest
+static const uint8_t* history_at(uint32_t age) {
+    return history[(history_head + CPU_HISTORY - 1 - age) % CPU_HISTORY];
 }
 
 int cpu_get_usage() {
-    if (total_ticks == 0) {
+    if (history_count == 0) {
         return 0;
     }
-    return 100 - (idle_ticks * 100) / total_ticks;
+    return 100 - history_at(0)[CPU_CTX_IDLE];
 }
 
-void cpu_tick() {
-    total_ticks++;
-}
\ No newline at end of file
+int cpu_get_average(int ctx, uint32_t seconds) {
+    if (seconds > history_count) {
+        seconds = history_count;
+    }
+    if (seconds == 0 || ctx < 0 || ctx >= CPU_CONTEXTS) {
+        return 0;
+    }
+    uint32_t sum = 0;
+    for (uint32_t age = 0; age < seconds; age++) {
+        sum += history_at(age)[ctx];
+    }
+    return sum / seconds;
+}
+
+uint32_t cpu_get_history(uint8_t* busy, uint32_t max) {
+    uint32_t count = history_count < max ? history_count : max;
+    for (uint32_t i = 0; i < count; i++) {
+        busy[i] = 100 - history_at(count - 1 - i)[CPU_CTX_IDLE];
+    }
+    return count;
+}
@@ -0,0 +1,93 @@
+#include "include/klog.h"
+#include "include/memcore.h"
+#include "include/timer.h"
+
+static klog_entry_t klog_ring[KLOG_ENTRIES];
+static volatile uint32_t klog_head = 0; // Next index to reserve
+static uint32_t klog_tail = 0;          // Next index to print to the console
+
+// Atomically reserve the next slot. lock xadd keeps this correct even if
+// an IRQ handler logs in the middle of another klog() call.
+static uint32_t klog_reserve() {
+    uint32_t idx = 1;
+    asm volatile("lock xaddl %0, %1" : "+r"(idx), "+m"(klog_head) : : "memory");
+    return idx;
+}
+
+void klog(const char* tag, const char* fmt, ...) {
+    uint32_t idx = klog_reserve();
+    klog_entry_t* entry = &klog_ring[idx % KLOG_ENTRIES];
+
+    entry->seq = 0;
+    asm volatile("" ::: "memory");
+
+    entry->ticks = timer_ticks;
+    strncpy(entry->tag, tag, KLOG_TAG_LEN - 1);
+    entry->tag[KLOG_TAG_LEN - 1] = '\0';
+
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(entry->msg, KLOG_MSG_LEN, fmt, args);
+    va_end(args);
+
+    asm volatile("" ::: "memory");
+    entry->seq = idx + 1; // Publish
+}
+
+void log(const char* tag, const char* msg) {
+    klog(tag, "%s", msg);
+}
+
+// Copy entry `idx` out of the ring. Returns 1 on success, 0 if it has not been
+// committed yet, -1 if it was already overwritten by a newer entry.
+static int klog_read(uint32_t idx, klog_entry_t* out) {
+    klog_entry_t* entry = &klog_ring[idx % KLOG_ENTRIES];
+    uint32_t seq = entry->seq;
+    if (seq != idx + 1) {
+        return (seq > idx + 1) ? -1 : 0;
+    }
+
+    memcpy(out, entry, sizeof(klog_entry_t));
+
+    // A producer may have lapped us while we were copying
+    asm volatile("" ::: "memory");
+    return entry->seq == seq ? 1 : -1;
+}
+
+static void klog_print(const klog_entry_t* entry) {
+    kprintf("[%5u.%02u] [%s] %s\n", entry->ticks / 100, entry->ticks % 100, entry->tag, entry->msg);
+}
+
+void klog_drain() {
+    uint32_t head = klog_head;
+
+    if (head - klog_tail > KLOG_ENTRIES) {
+        uint32_t lost = head - klog_tail - KLOG_ENTRIES;
+        klog_tail = head - KLOG_ENTRIES;
+        kprintf("[klog] %u messages dropped\n", lost);
+    }
+
+    while (klog_tail != head) {
+        klog_entry_t entry;
+        int result = klog_read(klog_tail, &entry);
+        if (result == 0) {
+            break; // Still being written; pick it up next time
+        }
+        if (result > 0) {
+            klog_print(&entry);
+        }
+        klog_tail++;
+    }
+}
+
+void klog_dump() {
+    uint32_t head = klog_head;
+    uint32_t idx = head > KLOG_ENTRIES ? head - KLOG_ENTRIES : 0;
+
+    for (; idx != head; idx++) {
+        klog_entry_t entry;
+        if (klog_read(idx, &entry) > 0) {
+            klog_print(&entry);
+        }
+    }
+}
@@ -0,0 +1,309 @@
+#include "include/sched.h"
+#include "include/heap.h"
+#include "include/memcore.h"
+#include "include/idt.h"
+#include "include/cpu.h"
+#include "include/timer.h"
+
+// Kernel threads are preempted from the IRQ path: every IRQ stub passes its
+// saved regs_t frame through sched_preempt(), which may hand back another
+// thread's frame to resume instead. A voluntary switch raises
+// SCHED_YIELD_VECTOR so that it saves exactly the same frame.
+
+static thread_t threads[SCHED_MAX_THREADS];
+static thread_t* current = 0;
+static thread_t* idle_thread = 0; // Runs only when nothing else is ready
+static thread_t* ready_head[SCHED_PRIORITIES];
+static thread_t* ready_tail[SCHED_PRIORITIES];
+static uint32_t next_id = 0;
+static uint32_t quantum_left = SCHED_QUANTUM;
+static int need_resched = 0;
+static wait_queue_t irq_waiters; // Threads idling until the next IRQ
+
+extern void sched_yield_stub();
+
+static void enqueue(thread_t* t) {
+    t->state = THREAD_READY;
+    if (t == idle_thread) {
+        return;
+    }
+    t->next = 0;
+    if (ready_tail[t->priority]) {
+        ready_tail[t->priority]->next = t;
+    } else {
+        ready_head[t->priority] = t;
+    }
+    ready_tail[t->priority] = t;
+}
+
+static thread_t* dequeue() {
+    for (int priority = 0; priority < SCHED_PRIORITIES; priority++) {
+        thread_t* t = ready_head[priority];
+        if (t) {
+            ready_head[priority] = t->next;
+            if (ready_head[priority] == 0) {
+                ready_tail[priority] = 0;
+            }
+            return t;
+        }
+    }
+    return idle_thread;
+}
+
+// Switch to the best ready thread. Runs with interrupts off on the stack of
+// the outgoing thread, so a thread that just exited is freed next time.
+static regs_t* schedule(regs_t* frame) {
+    for (int i = 0; i < SCHED_MAX_THREADS; i++) {
+        if (threads[i].state == THREAD_DEAD && &threads[i] != current) {
+            kfree(threads[i].stack);
+            threads[i].state = THREAD_UNUSED;
+        }
+    }
+
+    need_resched = 0;
+    current->esp = (uint32_t)frame;
+    current->space = paging_current_address_space();
+    if (current->state == THREAD_RUNNING) {
+        enqueue(current);
+    }
+
+    thread_t* next = dequeue();
+    next->state = THREAD_RUNNING;
+    current = next;
+    quantum_left = SCHED_QUANTUM;
+    paging_switch(next->space);
+    return (regs_t*)next->esp;
+}
+
+regs_t* sched_preempt(regs_t* frame) {
+    if (current == 0 || !need_resched) {
+        return frame;
+    }
+    return schedule(frame);
+}
+
+regs_t* sched_yield_handler(regs_t* frame) {
+    return schedule(frame);
+}
+
+static int ready_above(uint8_t priority) {
+    for (int p = 0; p < SCHED_PRIORITIES && p <= priority; p++) {
+        if (ready_head[p]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void sched_tick() {
+    if (current == 0) {
+        return;
+    }
+    current->cpu_ticks++;
+
+    if (current == idle_thread) {
+        if (sched_others_ready()) {
+            need_resched = 1;
+        }
+    } else if (--quantum_left == 0) {
+        // Only worth a switch if someone of the same or better priority waits
+        if (ready_above(current->priority)) {
+            need_resched = 1;
+        } else {
+            quantum_left = SCHED_QUANTUM;
+        }
+    }
+}
+
+static void idle_loop(void* arg) {
+    for (;;) {
+        cpu_idle();
+    }
+}
+
+static thread_t* alloc_thread(const char* name, uint8_t priority) {
+    for (int i = 0; i < SCHED_MAX_THREADS; i++) {
+        thread_t* t = &threads[i];
+        if (t->state == THREAD_UNUSED) {
+            memset(t, 0, sizeof(thread_t));
+            t->id = next_id++;
+            strncpy(t->name, name, sizeof(t->name) - 1);
+            t->priority = priority < SCHED_PRIORITIES ? priority : SCHED_PRIORITY_LOW;
+            return t;
+        }
+    }
+    return 0;
+}
+
+// Give a new thread a stack whose top looks like an interrupted frame, so
+// the first switch to it "returns" into entry(arg). entry returning lands in
+// thread_exit().
+static int setup_stack(thread_t* t, void (*entry)(void*), void* arg) {
+    t->stack = kmalloc(SCHED_STACK_SIZE);
+    if (t->stack == 0) {
+        return -1;
+    }
+    uint32_t* top = (uint32_t*)((uint8_t*)t->stack + SCHED_STACK_SIZE);
+    *--top = (uint32_t)arg;
+    *--top = (uint32_t)thread_exit;
+
+    // Same-privilege iret pops only eip, cs and eflags
+    regs_t* frame = (regs_t*)((uint8_t*)top - __builtin_offsetof(regs_t, useresp));
+    memset(frame, 0, __builtin_offsetof(regs_t, useresp));
+    frame->gs = frame->fs = frame->es = frame->ds = 0x10;
+    frame->eip = (uint32_t)entry;
+    frame->cs = 0x08;
+    frame->eflags = 0x202; // IF set
+    t->esp = (uint32_t)frame;
+    t->space = paging_kernel_address_space();
+    return 0;
+}
+
+// Turn the boot context into thread 0 and start the idle thread
+void sched_init() {
+    memset(threads, 0, sizeof(threads));
+    idt_set_gate(SCHED_YIELD_VECTOR, (unsigned)sched_yield_stub);
+
+    current = alloc_thread("shell", SCHED_PRIORITY_NORMAL);
+    current->state = THREAD_RUNNING;
+    current->space = paging_current_address_space();
+
+    idle_thread = alloc_thread("idle", SCHED_PRIORITY_LOW);
+    setup_stack(idle_thread, idle_loop, 0);
+    idle_thread->state = THREAD_READY;
+}
+
+int thread_create(const char* name, void (*entry)(void*), void* arg, uint8_t priority) {
+    unsigned int flags = irq_save();
+    thread_t* t = alloc_thread(name, priority);
+    if (t == 0 || setup_stack(t, entry, arg) != 0) {
+        if (t) {
+            t->state = THREAD_UNUSED;
+        }
+        irq_restore(flags);
+        return -1;
+    }
+    enqueue(t);
+    if (t->priority < current->priority) {
+        need_resched = 1;
+    }
+    irq_restore(flags);
+    return t->id;
+}
+
+void thread_exit() {
+    irq_save();
+    current->state = THREAD_DEAD;
+    sched_yield();
+    for (;;); // Not reached
+}
+
+void sched_yield() {
+    asm volatile("int %0" :: "i"(SCHED_YIELD_VECTOR) : "memory");
+}
+
+// Put a sleeping thread back on its run queue. Interrupts must be off.
+static void make_ready(thread_t* t) {
+    if (t->state != THREAD_SLEEPING) {
+        return;
+    }
+    enqueue(t);
+    if (current == idle_thread || t->priority < current->priority) {
+        need_resched = 1;
+    }
+}
+
+// Timer event callback, runs from the timer IRQ
+static void wake_thread(void* arg) {
+    make_ready(arg);
+}
+
+// Interrupts must be off, so the wakeup can't slip in between the caller's
+// check and the sleep. They are off again on return.
+void sched_wait(wait_queue_t* wq) {
+    current->state = THREAD_SLEEPING;
+    current->next = 0;
+    thread_t** link = &wq->head;
+    while (*link) {
+        link = &(*link)->next;
+    }
+    *link = current;
+    sched_yield();
+}
+
+void sched_wake_all(wait_queue_t* wq) {
+    unsigned int flags = irq_save();
+    thread_t* t = wq->head;
+    wq->head = 0;
+    while (t) {
+        thread_t* next = t->next;
+        make_ready(t);
+        t = next;
+    }
+    irq_restore(flags);
+}
+
+// Called from cpu_idle() with interrupts off. Returns 1 if the caller gave
+// the CPU away, 0 if it should halt itself. A thread only yields to equal
+// or better priority; with just lower ones ready it sleeps until the next
+// IRQ so they get to run, rather than being picked again straight away.
+int sched_idle_wait() {
+    if (current == 0) {
+        return 0;
+    }
+    if (current == idle_thread) {
+        if (sched_others_ready()) {
+            sched_yield();
+            return 1;
+        }
+        return 0;
+    }
+    if (ready_above(current->priority)) {
+        sched_yield();
+        return 1;
+    }
+    if (sched_others_ready()) {
+        sched_wait(&irq_waiters);
+        return 1;
+    }
+    return 0;
+}
+
+void sched_irq_wakeup() {
+    sched_wake_all(&irq_waiters);
+}
+
+void sched_sleep_us(uint32_t us) {
+    unsigned int flags = irq_save();
+    if (timer_add(ktime_ns() + (uint64_t)us * 1000, wake_thread, current) < 0) {
+        // Timer queue is full: at least give the CPU away once
+        irq_restore(flags);
+        sched_yield();
+        return;
+    }
+    current->state = THREAD_SLEEPING;
+    sched_yield();
+    irq_restore(flags);
+}
+
+void sched_sleep(uint32_t ticks) {
+    sched_sleep_us(ticks * (TIMER_TICK_NS / 1000));
+}
+
+int sched_others_ready() {
+    for (int p = 0; p < SCHED_PRIORITIES; p++) {
+        if (ready_head[p]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+thread_t* sched_current() {
+    return current;
+}
+
+uint32_t sched_get_threads(const thread_t** list) {
+    *list = threads;
+    return SCHED_MAX_THREADS;
+}
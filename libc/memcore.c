@@ -1,57 +1,70 @@
 #include "./include/memcore.h"
 #include "./include/ports.h"
 #include "./include/types.h"
+#include "./include/cpu.h"
 
 static int cursor_row = 0;
 static int cursor_col = 0;
 #define VGA_WIDTH 80
 #define VGA_HEIGHT 25
-#define SCROLLBACK_ROWS 100
 #define VGA_MEMORY ((char*)0xB8000)
-
+#define KPRINTF_BUFFER_SIZE 512
+
+// History depth in lines. Override with -DSCROLLBACK_ROWS=n in CFLAGS; a new
+// line costs the same no matter how deep the history is.
+#ifndef SCROLLBACK_ROWS
+#define SCROLLBACK_ROWS 2000
+#endif
+#if SCROLLBACK_ROWS < VGA_HEIGHT
+#error "SCROLLBACK_ROWS must cover at least one screen"
+#endif
+
+// The scrollback is a ring: logical row 0 (the oldest line kept) lives at
+// scrollback_head, and cursor_row, scrollback_row and view_row are all
+// logical rows. When the ring is full, the oldest line is recycled as the
+// new last line instead of shifting the whole history up.
 static char scrollback_buffer[SCROLLBACK_ROWS][VGA_WIDTH * 2];
+static int scrollback_head = 0;
 static int scrollback_row = 0;
 static int view_row = 0;
+static unsigned char clear_color = 0x07;
 
-typedef char* va_list;
-
-#define va_start(ap, last_arg) (ap = (char*)(&last_arg + 1))
-#define va_arg(ap, type)       (*(type*)((ap += sizeof(type)) - sizeof(type)))
-#define va_end(ap)             (ap = 0)
-
+static char* scrollback_line(int row) {
+    return scrollback_buffer[(scrollback_head + row) % SCROLLBACK_ROWS];
+}
 
-void* memcpy(void* dest, const void* src, unsigned int count) {
-    char* d = (char*)dest;
-    const char* s = (const char*)src;
-    for (unsigned int i = 0; i < count; i++) {
-        d[i] = s[i];
+static void clear_line(int row) {
+    char* line = scrollback_line(row);
+    for (int col = 0; col < VGA_WIDTH; col++) {
+        line[col * 2] = ' ';
+        line[col * 2 + 1] = clear_color;
     }
-    return dest;
 }
 
-void* memmove(void* dest, const void* src, unsigned int count) {
-    char* d = (char*)dest;
-    const char* s = (const char*)src;
-    if (d < s) {
-        for (unsigned int i = 0; i < count; i++) {
-            d[i] = s[i];
-        }
-    } else {
-        for (unsigned int i = count; i != 0; i--) {
-            d[i - 1] = s[i - 1];
-        }
-    }
-    return dest;
+// Output is written to scrollback_buffer first and copied to VGA memory by
+// console_flush(). Only the rows touched since the last flush are copied,
+// unless the view moved, in which case the whole screen is redrawn.
+static int dirty_first = SCROLLBACK_ROWS;
+static int dirty_last = -1;
+static int flushed_view_row = -1;   // View shown on screen, -1 forces a redraw
+static int flushed_cursor_pos = -1; // Last position sent to the CRTC
+static int console_batch = 0;       // Nesting depth of print()
+
+static void refresh_screen();
+
+static void mark_dirty(int row) {
+    if (row < dirty_first) dirty_first = row;
+    if (row > dirty_last) dirty_last = row;
 }
 
-void* memset(void* dest, int value, unsigned int count) {
-    char* d = (char*)dest;
-    for (unsigned int i = 0; i < count; i++) {
-        d[i] = (char)value;
+// Flush now unless a print()/kprintf() further up will do it when it's done
+static void console_maybe_flush() {
+    if (console_batch == 0) {
+        console_flush();
     }
-    return dest;
 }
 
+
 int strlen(const char* str) {
     int len = 0;
     while (str[len] != '\0') {
@@ -81,116 +94,88 @@ int strncmp(const char* str1, const char* str2, size_t n) {
 }
 
 void print_backspace() {
+    unsigned int flags = irq_save();
     if (cursor_col > 0) {
         cursor_col--;
         int offset = cursor_col * 2;
-        scrollback_buffer[cursor_row][offset] = ' ';
-        scrollback_buffer[cursor_row][offset + 1] = 0x07; // Default color
+        scrollback_line(cursor_row)[offset] = ' ';
+        scrollback_line(cursor_row)[offset + 1] = 0x07; // Default color
     } else if (cursor_row > 0) {
         cursor_row--;
         cursor_col = VGA_WIDTH - 1;
         int offset = cursor_col * 2;
-        scrollback_buffer[cursor_row][offset] = ' ';
-        scrollback_buffer[cursor_row][offset + 1] = 0x07; // Default color
+        scrollback_line(cursor_row)[offset] = ' ';
+        scrollback_line(cursor_row)[offset + 1] = 0x07; // Default color
     }
-    refresh_screen();
-    update_cursor();
+    mark_dirty(cursor_row);
+    console_maybe_flush();
+    irq_restore(flags);
 }
 
 void clear_screen(unsigned char color) {
-    for (int row = 0; row < SCROLLBACK_ROWS; row++) {
-        for (int col = 0; col < VGA_WIDTH; col++) {
-            int offset = col * 2;
-            scrollback_buffer[row][offset] = ' ';
-            scrollback_buffer[row][offset + 1] = color;
-        }
+    unsigned int flags = irq_save();
+    // Only the first screen needs wiping; later lines are cleared as the
+    // cursor first reaches them.
+    clear_color = color;
+    scrollback_head = 0;
+    for (int row = 0; row < VGA_HEIGHT; row++) {
+        clear_line(row);
     }
     cursor_row = 0;
     cursor_col = 0;
     scrollback_row = 0;
     view_row = 0;
-    refresh_screen();
+    flushed_view_row = -1;
+    console_flush();
+    irq_restore(flags);
 }
 
 void print_int(int number, unsigned char color) {
     char buffer[12]; // Enough for 32-bit int: -2147483648
-    int i = 0;
-    int is_negative = 0;
-
-    if (number == 0) {
-        print("0", color);
-        return;
-    }
-
-    if (number < 0) {
-        is_negative = 1;
-        number = -number;
-    }
-    while (number != 0) {
-        buffer[i++] = (number % 10) + '0';
-        number /= 10;
-    }
-
-    if (is_negative) buffer[i++] = '-';
-
-    // Reverse the buffer
-    for (int j = i - 1; j >= 0; j--) {
-        char c[2] = { buffer[j], 0 };
-        print(c, color);
-    }
+    snprintf(buffer, sizeof(buffer), "%d", number);
+    print(buffer, color);
 }
 
 void print_uint(unsigned int number, unsigned char color) {
     char buffer[11]; // Enough for 32-bit unsigned int
-    int i = 0;
-
-    if (number == 0) {
-        print("0", color);
-        return;
-    }
-
-    while (number != 0) {
-        buffer[i++] = (number % 10) + '0';
-        number /= 10;
-    }
-
-    // Reverse the buffer
-    for (int j = i - 1; j >= 0; j--) {
-        char c[2] = { buffer[j], 0 };
-        print(c, color);
-    }
+    snprintf(buffer, sizeof(buffer), "%u", number);
+    print(buffer, color);
 }
 
 void print_hex(unsigned int number, unsigned char color) {
-    char hex_chars[] = "0123456789ABCDEF";
-    print("0x", color);
-
-    for (int i = 28; i >= 0; i -= 4) {
-        char digit = hex_chars[(number >> i) & 0xF];
-        char c[2] = { digit, 0 };
-        print(c, color);
-    }
+    char buffer[11];
+    snprintf(buffer, sizeof(buffer), "0x%08X", number);
+    print(buffer, color);
 }
 
 
 void print(const char* msg, unsigned char color) {
+    unsigned int flags = irq_save();
+    console_batch++;
     for (int i = 0; msg[i] != 0; ++i) {
         print_char(msg[i], color);
     }
+    console_batch--;
+    console_maybe_flush();
+    irq_restore(flags);
 }
 
 void scroll_up() {
+    unsigned int flags = irq_save();
     if (view_row > 0) {
         view_row--;
-        refresh_screen();
+        console_flush();
     }
+    irq_restore(flags);
 }
 
 void scroll_down() {
+    unsigned int flags = irq_save();
     if (view_row < scrollback_row) {
         view_row++;
-        refresh_screen();
+        console_flush();
     }
+    irq_restore(flags);
 }
 
 void panic(const char* msg) {
@@ -202,22 +187,18 @@ void panic(const char* msg) {
     }
 }
 
-void log(const char* tag, const char* msg) {
-    print("[", 0x07);
-    print(tag, 0x07);
-    print("] ", 0x07);
-    print(msg, 0x07);
-    print("\n", 0x07);
-}
-
 void print_char(char c, unsigned char color) {
+    // The cursor and scrollback are shared by every thread
+    unsigned int flags = irq_save();
     if (c == '\n') {
         cursor_col = 0;
         cursor_row++;
     } else {
         int offset = cursor_col * 2;
-        scrollback_buffer[cursor_row][offset] = c;
-        scrollback_buffer[cursor_row][offset + 1] = color;
+        char* line = scrollback_line(cursor_row);
+        line[offset] = c;
+        line[offset + 1] = color;
+        mark_dirty(cursor_row);
         cursor_col++;
     }
 
@@ -227,22 +208,15 @@ void print_char(char c, unsigned char color) {
     }
 
     if (cursor_row > scrollback_row) {
-        scrollback_row = cursor_row;
-    }
-
-    if (cursor_row >= SCROLLBACK_ROWS) {
-        // Shift buffer up
-        for (int i = 1; i < SCROLLBACK_ROWS; i++) {
-            memcpy(scrollback_buffer[i - 1], scrollback_buffer[i], VGA_WIDTH * 2);
-        }
-        // Clear last line
-        for (int i = 0; i < VGA_WIDTH; i++) {
-            scrollback_buffer[SCROLLBACK_ROWS - 1][i * 2] = ' ';
-            scrollback_buffer[SCROLLBACK_ROWS - 1][i * 2 + 1] = 0x07;
+        if (cursor_row >= SCROLLBACK_ROWS) {
+            // Ring is full: drop the oldest line and reuse its slot
+            scrollback_head = (scrollback_head + 1) % SCROLLBACK_ROWS;
+            cursor_row--;
+            flushed_view_row = -1; // Every visible row moved up
         }
-        cursor_row--;
-        scrollback_row--;
-        view_row--;
+        scrollback_row = cursor_row;
+        clear_line(cursor_row);
+        mark_dirty(cursor_row);
     }
 
     view_row = scrollback_row - VGA_HEIGHT + 1;
@@ -250,8 +224,8 @@ void print_char(char c, unsigned char color) {
         view_row = 0;
     }
 
-    refresh_screen();
-    update_cursor();
+    console_maybe_flush();
+    irq_restore(flags);
 }
 
 void println(const char* msg, unsigned char color) {
@@ -260,55 +234,188 @@ void println(const char* msg, unsigned char color) {
 }
 
 
-void kprintf(const char* fmt, ...) {
-    va_list args;
-    va_start(args, fmt);
+// --- Formatting engine shared by kprintf() and snprintf() ---
+//
+// Conversions: %d %i %u %x %X %p %s %c %%
+// Flags: '-' (left justify), '0' (zero pad), '#' (0x prefix for %x/%X)
+// Width and precision may be given inline or as '*'. Precision limits %s.
+// Length: 'l' (same as int here), 'll' for 64-bit values.
+
+typedef struct {
+    char* buf;
+    unsigned int size;
+    unsigned int pos;
+} fmt_out_t;
+
+static void fmt_putc(fmt_out_t* out, char c) {
+    if (out->pos + 1 < out->size) {
+        out->buf[out->pos++] = c;
+    }
+}
 
-    for (int i = 0; fmt[i] != '\0'; i++) {
-        if (fmt[i] == '%') {
+static void fmt_pad(fmt_out_t* out, char c, int count) {
+    while (count-- > 0) {
+        fmt_putc(out, c);
+    }
+}
+
+// Divide *n by base in place and return the remainder. Done in two 32-bit
+// steps so we don't need libgcc's __udivdi3/__umoddi3.
+static uint32_t fmt_divmod(uint64_t* n, uint32_t base) {
+    uint32_t high = (uint32_t)(*n >> 32);
+    uint32_t low = (uint32_t)*n;
+    uint32_t rem = high % base;
+    high /= base;
+    asm("divl %4" : "=a"(low), "=d"(rem) : "a"(low), "d"(rem), "rm"(base));
+    *n = ((uint64_t)high << 32) | low;
+    return rem;
+}
+
+static void fmt_number(fmt_out_t* out, uint64_t value, int negative, uint32_t base,
+                       int upper, const char* prefix, int width, int left, int zero) {
+    const char* digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    char tmp[24];
+    int len = 0;
+
+    do {
+        tmp[len++] = digits[fmt_divmod(&value, base)];
+    } while (value != 0);
+
+    int extra = (negative ? 1 : 0) + (prefix ? strlen(prefix) : 0);
+    int padding = width - len - extra;
+
+    if (!left && !zero) fmt_pad(out, ' ', padding);
+    if (negative) fmt_putc(out, '-');
+    while (prefix && *prefix) fmt_putc(out, *prefix++);
+    if (!left && zero) fmt_pad(out, '0', padding);
+    while (len > 0) fmt_putc(out, tmp[--len]);
+    if (left) fmt_pad(out, ' ', padding);
+}
+
+int vsnprintf(char* str, unsigned int size, const char* format, va_list args) {
+    fmt_out_t out = { str, size, 0 };
+
+    for (int i = 0; format[i] != '\0'; i++) {
+        if (format[i] != '%') {
+            fmt_putc(&out, format[i]);
+            continue;
+        }
+        i++;
+
+        int left = 0, zero = 0, alt = 0;
+        for (;; i++) {
+            if (format[i] == '-') left = 1;
+            else if (format[i] == '0') zero = 1;
+            else if (format[i] == '#') alt = 1;
+            else break;
+        }
+
+        int width = 0;
+        if (format[i] == '*') {
+            width = va_arg(args, int);
+            if (width < 0) {
+                left = 1;
+                width = -width;
+            }
             i++;
-            char spec = fmt[i];
-            switch (spec) {
-                case 'd': {
-                    int val = va_arg(args, int);
-                    print_int(val, 0x07);
-                    break;
-                }
-                case 'u': {
-                    unsigned int val = va_arg(args, unsigned int);
-                    print_uint(val, 0x07);
-                    break;
-                }
-                case 'x': {
-                    unsigned int val = va_arg(args, unsigned int);
-                    print_hex(val, 0x07);
-                    break;
-                }
-                case 's': {
-                    const char* str = va_arg(args, const char*);
-                    print(str, 0x07);
-                    break;
-                }
-                case 'c': {
-                    char c = (char)va_arg(args, int); // promote to int
-                    print_char(c, 0x07);
-                    break;
-                }
-                case '%': {
-                    print_char('%', 0x07);
-                    break;
+        } else {
+            while (format[i] >= '0' && format[i] <= '9') {
+                width = width * 10 + (format[i++] - '0');
+            }
+        }
+
+        int precision = -1;
+        if (format[i] == '.') {
+            i++;
+            precision = 0;
+            if (format[i] == '*') {
+                precision = va_arg(args, int);
+                i++;
+            } else {
+                while (format[i] >= '0' && format[i] <= '9') {
+                    precision = precision * 10 + (format[i++] - '0');
                 }
-                default:
-                    print_char('%', 0x07);
-                    print_char(spec, 0x07);
-                    break;
             }
-        } else {
-            print_char(fmt[i], 0x07);
         }
+
+        int is_long_long = 0;
+        if (format[i] == 'l') {
+            i++;
+            if (format[i] == 'l') {
+                is_long_long = 1;
+                i++;
+            }
+        }
+
+        char spec = format[i];
+        switch (spec) {
+            case 'd':
+            case 'i': {
+                long long val = is_long_long ? va_arg(args, long long) : va_arg(args, int);
+                int negative = val < 0;
+                uint64_t magnitude = negative ? (uint64_t)-val : (uint64_t)val;
+                fmt_number(&out, magnitude, negative, 10, 0, 0, width, left, zero);
+                break;
+            }
+            case 'u':
+            case 'x':
+            case 'X': {
+                uint64_t val = is_long_long ? va_arg(args, uint64_t) : va_arg(args, unsigned int);
+                uint32_t base = spec == 'u' ? 10 : 16;
+                const char* prefix = (alt && base == 16) ? (spec == 'X' ? "0X" : "0x") : 0;
+                fmt_number(&out, val, 0, base, spec == 'X', prefix, width, left, zero);
+                break;
+            }
+            case 'p': {
+                uint32_t val = (uint32_t)va_arg(args, void*);
+                fmt_number(&out, val, 0, 16, 0, "0x", width > 10 ? width : 10, left, 1);
+                break;
+            }
+            case 's': {
+                const char* str_arg = va_arg(args, const char*);
+                if (!str_arg) str_arg = "(null)";
+                int len = 0;
+                while (str_arg[len] && (precision < 0 || len < precision)) len++;
+                if (!left) fmt_pad(&out, ' ', width - len);
+                for (int j = 0; j < len; j++) fmt_putc(&out, str_arg[j]);
+                if (left) fmt_pad(&out, ' ', width - len);
+                break;
+            }
+            case 'c': {
+                char c = (char)va_arg(args, int); // promote to int
+                if (!left) fmt_pad(&out, ' ', width - 1);
+                fmt_putc(&out, c);
+                if (left) fmt_pad(&out, ' ', width - 1);
+                break;
+            }
+            case '%':
+                fmt_putc(&out, '%');
+                break;
+            case '\0':
+                i--; // Lone '%' at the end of the format
+                break;
+            default:
+                fmt_putc(&out, '%');
+                fmt_putc(&out, spec);
+                break;
+        }
+    }
+
+    if (size > 0) {
+        str[out.pos] = '\0';
     }
+    return out.pos;
+}
 
+// Formats into a stack buffer and hands the whole line to the console in one
+// write. Output longer than KPRINTF_BUFFER_SIZE - 1 characters is truncated.
+void kprintf(const char* fmt, ...) {
+    char buffer[KPRINTF_BUFFER_SIZE];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buffer, sizeof(buffer), fmt, args);
     va_end(args);
+    print(buffer, 0x07);
 }
 
 char* strcpy(char* dest, const char* src) {
@@ -402,52 +509,10 @@ char* strncpy(char* dest, const char* src, unsigned int n) {
        return strncmp(str + str_len - suffix_len, suffix, suffix_len) == 0;
    }
    
-   // A very basic snprintf that only handles %s, %c, and %d
    int snprintf(char* str, unsigned int size, const char* format, ...) {
        va_list args;
        va_start(args, format);
-   
-       unsigned int written = 0;
-       for (int i = 0; format[i] != '\0' && written < size - 1; i++) {
-           if (format[i] == '%') {
-               i++;
-               switch (format[i]) {
-                   case 'c': {
-                       char c = (char)va_arg(args, int);
-                       str[written++] = c;
-                       break;
-                   }
-                   case 's': {
-                       const char* s = va_arg(args, const char*);
-                       while (*s && written < size - 1) {
-                           str[written++] = *s++;
-                       }
-                       break;
-                   }
-                   case 'd': {
-                       int n = va_arg(args, int);
-                       char buf[12];
-                       int j = 0;
-                       if (n < 0) {
-                           str[written++] = '-';
-                           n = -n;
-                       }
-                       do {
-                           buf[j++] = (n % 10) + '0';
-                           n /= 10;
-                       } while (n > 0);
-                       while (j > 0 && written < size - 1) {
-                           str[written++] = buf[--j];
-                       }
-                       break;
-                   }
-               }
-           } else {
-               str[written++] = format[i];
-           }
-       }
-   
-       str[written] = '\0';
+       int written = vsnprintf(str, size, format, args);
        va_end(args);
        return written;
    }
@@ -463,22 +528,48 @@ char* strncpy(char* dest, const char* src, unsigned int n) {
        if (x >= VGA_WIDTH || y >= VGA_HEIGHT) return;
        cursor_col = x;
        cursor_row = y;
+       // Rows past the end of the history may hold recycled lines
+       while (scrollback_row < cursor_row) {
+           scrollback_row++;
+           clear_line(scrollback_row);
+       }
        update_cursor();
    }
    
    void update_cursor() {
        uint16_t pos = (cursor_row - view_row) * VGA_WIDTH + cursor_col;
+       if (pos == flushed_cursor_pos) {
+           return; // Skip the four port writes
+       }
+       flushed_cursor_pos = pos;
        outb(0x3D4, 0x0F);
        outb(0x3D5, (uint8_t)(pos & 0xFF));
        outb(0x3D4, 0x0E);
        outb(0x3D5, (uint8_t)((pos >> 8) & 0xFF));
    }
    
-   void refresh_screen() {
+   // Redraw every visible row
+   static void refresh_screen() {
        for (int row = 0; row < VGA_HEIGHT; row++) {
            int buffer_row = view_row + row;
            if (buffer_row < SCROLLBACK_ROWS) {
-               memcpy(VGA_MEMORY + row * VGA_WIDTH * 2, scrollback_buffer[buffer_row], VGA_WIDTH * 2);
+               memcpy(VGA_MEMORY + row * VGA_WIDTH * 2, scrollback_line(buffer_row), VGA_WIDTH * 2);
+           }
+       }
+       flushed_view_row = view_row;
+   }
+
+   void console_flush() {
+       if (view_row != flushed_view_row) {
+           refresh_screen();
+       } else {
+           int first = dirty_first > view_row ? dirty_first : view_row;
+           int last = dirty_last < view_row + VGA_HEIGHT - 1 ? dirty_last : view_row + VGA_HEIGHT - 1;
+           for (int row = first; row <= last; row++) {
+               memcpy(VGA_MEMORY + (row - view_row) * VGA_WIDTH * 2, scrollback_line(row), VGA_WIDTH * 2);
            }
        }
+       dirty_first = SCROLLBACK_ROWS;
+       dirty_last = -1;
+       update_cursor();
    }
@@ -0,0 +1,109 @@
+#include "./include/memcore.h"
+
+// Block memory primitives. Everything funnels through here (screen refresh,
+// BDFS table sync, the editor), so they move a 32-bit word per iteration and
+// hand large blocks to `rep movsd` / `rep stosd`.
+//
+// Addresses are only ever inspected as `unsigned long` so that this file also
+// builds on the host for tools/memops_bench.c.
+
+// Below this many bytes the startup cost of a string instruction outweighs it
+#define MEMOPS_REP_THRESHOLD 256
+
+#define MEMOPS_ALIGNED(p) ((((unsigned long)(p)) & 3) == 0)
+
+// A 32-bit word that may alias anything we copy
+typedef uint32_t __attribute__((may_alias)) memops_word_t;
+
+void* memcpy(void* dest, const void* src, unsigned int count) {
+    uint8_t* d = (uint8_t*)dest;
+    const uint8_t* s = (const uint8_t*)src;
+
+    // Align the destination so every word store lands on a word boundary
+    while (count && !MEMOPS_ALIGNED(d)) {
+        *d++ = *s++;
+        count--;
+    }
+
+    if (count >= MEMOPS_REP_THRESHOLD) {
+        unsigned int words = count / 4;
+        // cld: an IRQ may interrupt memmove's backward loop with DF unknown
+        asm volatile("cld; rep movsl"
+                     : "+D"(d), "+S"(s), "+c"(words)
+                     :
+                     : "memory");
+        count &= 3;
+    } else {
+        while (count >= 4) {
+            *(memops_word_t*)d = *(const memops_word_t*)s;
+            d += 4;
+            s += 4;
+            count -= 4;
+        }
+    }
+
+    while (count--) {
+        *d++ = *s++;
+    }
+    return dest;
+}
+
+void* memmove(void* dest, const void* src, unsigned int count) {
+    uint8_t* d = (uint8_t*)dest;
+    const uint8_t* s = (const uint8_t*)src;
+
+    // A forward copy is safe unless dest starts inside the source block
+    if (d <= s || d >= s + count) {
+        return memcpy(dest, src, count);
+    }
+
+    // Overlapping with dest above src: copy from the end. Backward string
+    // instructions are not fast-string accelerated, so stay in C here.
+    d += count;
+    s += count;
+    while (count && !MEMOPS_ALIGNED(d)) {
+        *--d = *--s;
+        count--;
+    }
+    while (count >= 4) {
+        d -= 4;
+        s -= 4;
+        *(memops_word_t*)d = *(const memops_word_t*)s;
+        count -= 4;
+    }
+    while (count--) {
+        *--d = *--s;
+    }
+    return dest;
+}
+
+void* memset(void* dest, int value, unsigned int count) {
+    uint8_t* d = (uint8_t*)dest;
+    uint8_t byte = (uint8_t)value;
+
+    while (count && !MEMOPS_ALIGNED(d)) {
+        *d++ = byte;
+        count--;
+    }
+
+    uint32_t word = byte * 0x01010101u;
+    if (count >= MEMOPS_REP_THRESHOLD) {
+        unsigned int words = count / 4;
+        asm volatile("cld; rep stosl"
+                     : "+D"(d), "+c"(words)
+                     : "a"(word)
+                     : "memory");
+        count &= 3;
+    } else {
+        while (count >= 4) {
+            *(memops_word_t*)d = word;
+            d += 4;
+            count -= 4;
+        }
+    }
+
+    while (count--) {
+        *d++ = byte;
+    }
+    return dest;
+}
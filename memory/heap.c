@@ -1,31 +1,264 @@
 #include "include/heap.h"
+#include "include/paging.h"
+#include "include/memcore.h"
+#include "include/cpu.h"
 
-static uint8_t* heap_ptr = (uint8_t*)HEAP_START;
+// The heap window is carved into 4KB pages that are only backed by a physical
+// frame while something lives in them. Small requests are served from
+// per-size-class slabs (one page each), larger ones take a run of whole pages.
+#define HEAP_PAGE_SIZE 4096
+#define HEAP_PAGES ((HEAP_END - HEAP_START) / HEAP_PAGE_SIZE)
 
-void* kmalloc(uint32_t size) {
-    if ((uint32_t)heap_ptr + size > HEAP_END) {
-        return 0; // Out of heap space
+// Size classes: 16, 32, 64, ... 2048 bytes
+#define HEAP_MIN_SHIFT   4
+#define HEAP_NUM_CLASSES 8
+#define HEAP_MAX_SMALL   (1 << (HEAP_MIN_SHIFT + HEAP_NUM_CLASSES - 1))
+
+// Page kinds
+#define HEAP_PAGE_FREE  0 // Not mapped
+#define HEAP_PAGE_SLAB  1 // Backs a slab of one size class
+#define HEAP_PAGE_LARGE 2 // First page of a large allocation
+#define HEAP_PAGE_TAIL  3 // Continuation page of a large allocation
+
+// Per-page bookkeeping, indexed by (virt - HEAP_START) / HEAP_PAGE_SIZE.
+// List links are page index + 1 so that 0 can mean "none".
+typedef struct {
+    uint8_t  kind;
+    uint8_t  class_idx;
+    uint16_t inuse;     // Objects handed out from this slab
+    uint16_t pages;     // Run length of a large allocation
+    uint16_t prev;
+    uint16_t next;
+    void*    free_list; // First free object in this slab
+} heap_page_t;
+
+static heap_page_t heap_pages[HEAP_PAGES];
+static uint16_t partial_slabs[HEAP_NUM_CLASSES]; // Slabs with at least one free object
+static uint32_t first_free_page = 0;             // No free page exists below this index
+static uint32_t mapped_pages = 0;
+
+static uint32_t page_to_virt(uint32_t page) {
+    return HEAP_START + page * HEAP_PAGE_SIZE;
+}
+
+static uint32_t class_size(uint32_t class_idx) {
+    return 1 << (HEAP_MIN_SHIFT + class_idx);
+}
+
+// Smallest class that fits `size` (caller guarantees size <= HEAP_MAX_SMALL)
+static uint32_t size_to_class(uint32_t size) {
+    uint32_t class_idx = 0;
+    while (class_size(class_idx) < size) {
+        class_idx++;
     }
+    return class_idx;
+}
 
-    void* new_alloc = heap_ptr;
-    heap_ptr += size;
-    return new_alloc;
+// Unmap pages [page, page + count) and hand their frames back to the PMM
+static void release_pages(uint32_t page, uint32_t count) {
+    paging_batch_begin(PAGE_OWNER_HEAP);
+    for (uint32_t i = page; i < page + count; i++) {
+        uint32_t virt = page_to_virt(i);
+        pmm_free_block((void*)(get_phys_addr(virt) & ~(HEAP_PAGE_SIZE - 1)));
+        unmap_page(virt);
+        memset(&heap_pages[i], 0, sizeof(heap_page_t));
+        mapped_pages--;
+    }
+    paging_batch_commit();
+    if (page < first_free_page) {
+        first_free_page = page;
+    }
 }
 
-void* alloc_aligned(uint32_t size, uint32_t alignment) {
-    uint32_t addr = (uint32_t)heap_ptr;
-    if (addr % alignment != 0) {
-        addr = (addr + alignment - 1) & ~(alignment - 1);
+// Find `count` free pages whose start is a multiple of `align_pages`, back
+// them with physical frames and return the first page index, or -1.
+static int32_t acquire_pages(uint32_t count, uint32_t align_pages) {
+    uint32_t page = first_free_page;
+    while (page + count <= HEAP_PAGES) {
+        if (page % align_pages != 0) {
+            page += align_pages - (page % align_pages);
+            continue;
+        }
+
+        uint32_t run = 0;
+        while (run < count && heap_pages[page + run].kind == HEAP_PAGE_FREE) {
+            run++;
+        }
+        if (run < count) {
+            page += run + 1;
+            continue;
+        }
+
+        paging_batch_begin(PAGE_OWNER_HEAP);
+        for (uint32_t i = 0; i < count; i++) {
+            void* frame = pmm_alloc_block();
+            if (frame == 0) {
+                paging_batch_commit();
+                release_pages(page, i);
+                return -1; // Out of physical memory
+            }
+            pmm_set_owner(frame, 1, PAGE_OWNER_HEAP);
+            map_page((uint32_t)frame, page_to_virt(page + i), PTE_PRESENT | PTE_RW);
+            heap_pages[page + i].kind = HEAP_PAGE_TAIL;
+            mapped_pages++;
+        }
+        paging_batch_commit();
+
+        if (page == first_free_page) {
+            first_free_page = page + count;
+        }
+        return page;
+    }
+    return -1; // Heap window exhausted
+}
+
+static void partial_push(uint32_t class_idx, uint32_t page) {
+    heap_page_t* pg = &heap_pages[page];
+    pg->prev = 0;
+    pg->next = partial_slabs[class_idx];
+    if (pg->next) {
+        heap_pages[pg->next - 1].prev = page + 1;
+    }
+    partial_slabs[class_idx] = page + 1;
+}
+
+static void partial_remove(uint32_t class_idx, uint32_t page) {
+    heap_page_t* pg = &heap_pages[page];
+    if (pg->prev) {
+        heap_pages[pg->prev - 1].next = pg->next;
+    } else {
+        partial_slabs[class_idx] = pg->next;
+    }
+    if (pg->next) {
+        heap_pages[pg->next - 1].prev = pg->prev;
+    }
+    pg->prev = 0;
+    pg->next = 0;
+}
+
+// Back a fresh page and thread all of its objects onto the slab free list
+static int32_t slab_create(uint32_t class_idx) {
+    int32_t page = acquire_pages(1, 1);
+    if (page < 0) {
+        return -1;
+    }
+
+    heap_page_t* pg = &heap_pages[page];
+    uint32_t size = class_size(class_idx);
+    uint8_t* base = (uint8_t*)page_to_virt(page);
+
+    pg->kind = HEAP_PAGE_SLAB;
+    pg->class_idx = class_idx;
+    pg->inuse = 0;
+    pg->free_list = 0;
+    for (uint32_t offset = HEAP_PAGE_SIZE; offset >= size; offset -= size) {
+        void* obj = base + offset - size;
+        *(void**)obj = pg->free_list;
+        pg->free_list = obj;
+    }
+
+    partial_push(class_idx, page);
+    return page;
+}
+
+static void* slab_alloc(uint32_t class_idx) {
+    if (!partial_slabs[class_idx] && slab_create(class_idx) < 0) {
+        return 0;
+    }
+
+    uint32_t page = partial_slabs[class_idx] - 1;
+    heap_page_t* pg = &heap_pages[page];
+    void* obj = pg->free_list;
+    pg->free_list = *(void**)obj;
+    pg->inuse++;
+
+    if (!pg->free_list) {
+        partial_remove(class_idx, page); // Slab is now full
+    }
+    return obj;
+}
+
+static void slab_free(uint32_t page, void* ptr) {
+    heap_page_t* pg = &heap_pages[page];
+    uint32_t class_idx = pg->class_idx;
+
+    if (!pg->free_list) {
+        partial_push(class_idx, page); // Was full, has room again
+    }
+    *(void**)ptr = pg->free_list;
+    pg->free_list = ptr;
+    pg->inuse--;
+
+    // Give empty slabs back, but keep the last one of a class around so a
+    // single alloc/free pair at the boundary doesn't map and unmap a page.
+    if (pg->inuse == 0 && (pg->prev || pg->next)) {
+        partial_remove(class_idx, page);
+        release_pages(page, 1);
     }
-    if (addr + size > HEAP_END) {
+}
+
+static void* large_alloc(uint32_t size, uint32_t alignment) {
+    uint32_t count = (size + HEAP_PAGE_SIZE - 1) / HEAP_PAGE_SIZE;
+    uint32_t align_pages = alignment > HEAP_PAGE_SIZE ? alignment / HEAP_PAGE_SIZE : 1;
+    if (count == 0) {
+        count = 1;
+    }
+
+    int32_t page = acquire_pages(count, align_pages);
+    if (page < 0) {
         return 0;
     }
-    heap_ptr = (uint8_t*)(addr + size);
-    return (void*)addr;
+
+    heap_pages[page].kind = HEAP_PAGE_LARGE;
+    heap_pages[page].pages = count;
+    return (void*)page_to_virt(page);
+}
+
+// The public entry points run with interrupts off: the slab lists and page
+// table are shared by every kernel thread.
+void* kmalloc(uint32_t size) {
+    unsigned int flags = irq_save();
+    void* ptr;
+    if (size <= HEAP_MAX_SMALL) {
+        ptr = slab_alloc(size_to_class(size));
+    } else {
+        ptr = large_alloc(size, HEAP_PAGE_SIZE);
+    }
+    irq_restore(flags);
+    return ptr;
+}
+
+void* alloc_aligned(uint32_t size, uint32_t alignment) {
+    unsigned int flags = irq_save();
+    void* ptr;
+    // Slab objects sit at multiples of their class size inside a page-aligned
+    // slab, so any power-of-two alignment up to the class size comes for free.
+    uint32_t needed = size > alignment ? size : alignment;
+    if (needed <= HEAP_MAX_SMALL) {
+        ptr = slab_alloc(size_to_class(needed));
+    } else {
+        ptr = large_alloc(size, alignment);
+    }
+    irq_restore(flags);
+    return ptr;
 }
 
 void kfree(void* ptr) {
-    // A bump allocator doesn't really have a "free"
-    // but we can add a stub for API compatibility.
-    (void)ptr; // Avoid unused parameter warning
-}
\ No newline at end of file
+    uint32_t addr = (uint32_t)ptr;
+    if (addr < HEAP_START || addr >= HEAP_END) {
+        return; // NULL or not a heap pointer
+    }
+
+    unsigned int flags = irq_save();
+    uint32_t page = (addr - HEAP_START) / HEAP_PAGE_SIZE;
+    if (heap_pages[page].kind == HEAP_PAGE_SLAB) {
+        slab_free(page, ptr);
+    } else if (heap_pages[page].kind == HEAP_PAGE_LARGE) {
+        release_pages(page, heap_pages[page].pages);
+    }
+    irq_restore(flags);
+}
+
+uint32_t heap_get_usage() {
+    return mapped_pages * HEAP_PAGE_SIZE;
+}
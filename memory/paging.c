@@ -2,16 +2,191 @@
 #include "include/regs.h"
 #include "include/isr.h"
 #include "include/memcore.h"
+#include "include/vma.h"
+#include "include/heap.h"
+#include "include/cpu.h"
 
-// Page directory and table placed at specific physical addresses
+// Page directory and table placed at specific physical addresses. This is
+// the kernel's own address space and holds the master copy of the kernel
+// PDEs; it stays reachable through the identity map from every space.
 page_directory_t* page_directory = (page_directory_t*)0x90000;
 page_table_t* first_page_table = (page_table_t*)0x91000;
 
+// The directory CR3 points at. Before paging is on that is page_directory
+// itself, afterwards it is reached through the recursive slot.
+static page_directory_t* active_directory = (page_directory_t*)0x90000;
+
+// PDE 1022 is a second recursive slot that can point at another address
+// space's directory: its tables appear at FOREIGN_TABLES + pd_idx * 4KB and
+// the directory itself at FOREIGN_DIRECTORY.
+#define FOREIGN_PDE       1022
+#define FOREIGN_TABLES    0xFF800000
+#define FOREIGN_DIRECTORY ((page_directory_t*)0xFFFFE000)
+
+static address_space_t kernel_space = { 0x90000, 0 };
+static address_space_t* current_space = &kernel_space;
+static uint32_t kernel_pde_generation = 0; // Bumped whenever a kernel PDE changes
+
+// Bounce buffer for copy-on-write faults
+static uint8_t cow_buffer[4096] __attribute__((aligned(4096)));
+
+// Set when the CPU supports 4MB pages and CR4.PSE is on
+static int pse_enabled = 0;
+
+static int cpu_has_pse() {
+    uint32_t eax = 1, ebx, ecx, edx;
+    asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    return (edx >> 3) & 1; // CPUID.1:EDX.PSE
+}
+
+// Past this many pending pages a CR3 reload is cheaper than invlpg each
+#define PAGING_BATCH_MAX 32
+
+static uint32_t batch_depth = 0;
+static uint8_t batch_owner = PAGE_OWNER_KERNEL; // Charged for flushes, also outside batches
+static uint32_t batch_pending[PAGING_BATCH_MAX];
+static uint32_t batch_count = 0;
+static int batch_full_flush = 0;
+static uint32_t batch_pd_idx = 0xFFFFFFFF; // PDE already checked in this batch
+static paging_stats_t paging_stats[PAGE_OWNER_COUNT];
+static unsigned int batch_irq_flags = 0; // Interrupts stay off while a batch is open
+
+static page_table_t* table_for(uint32_t pd_idx) {
+    return (page_table_t*)(0xFFC00000 | (pd_idx << 12));
+}
+
+static page_table_t* foreign_table_for(uint32_t pd_idx) {
+    return (page_table_t*)(FOREIGN_TABLES | (pd_idx << 12));
+}
+
+static int is_user_pde(uint32_t pd_idx) {
+    return pd_idx >= (USER_SPACE_START >> 22) && pd_idx < (USER_SPACE_END >> 22);
+}
+
+static int is_kernel_pde(uint32_t pd_idx) {
+    return !is_user_pde(pd_idx) && pd_idx < FOREIGN_PDE;
+}
+
+// A PDE of the active directory changed. Kernel PDEs are shared by every
+// address space, so record it in the master copy; other spaces pick it up
+// the next time they are switched to.
+static void pde_changed(uint32_t pd_idx) {
+    if (!is_kernel_pde(pd_idx)) {
+        return;
+    }
+    if (current_space != &kernel_space) {
+        page_directory->tables[pd_idx] = active_directory->tables[pd_idx];
+    }
+    kernel_pde_generation++;
+    current_space->kernel_generation = kernel_pde_generation;
+}
+
+static void flush_tlb() {
+    uint32_t cr3;
+    asm volatile("mov %%cr3, %0; mov %0, %%cr3" : "=r"(cr3) :: "memory");
+    paging_stats[batch_owner].full_flushes++;
+}
+
+static void invlpg(uint32_t virt_addr) {
+    asm volatile("invlpg (%0)" :: "r"(virt_addr) : "memory");
+    paging_stats[batch_owner].invlpg++;
+}
+
+// A mapping changed: flush it now, or remember it until the batch commits
+static void invalidate(uint32_t virt_addr) {
+    if (batch_depth == 0) {
+        invlpg(virt_addr);
+    } else if (!batch_full_flush) {
+        if (batch_count == PAGING_BATCH_MAX) {
+            batch_full_flush = 1;
+        } else {
+            batch_pending[batch_count++] = virt_addr;
+        }
+    }
+}
+
+static void set_large_pde(uint32_t pd_idx, uint32_t phys_addr, uint32_t flags) {
+    page_directory_entry_t* pde = &active_directory->tables[pd_idx];
+    memset(pde, 0, sizeof(page_directory_entry_t));
+    pde->present = 1;
+    pde->rw = (flags & PTE_RW) ? 1 : 0;
+    pde->user = (flags & PTE_USER) ? 1 : 0;
+    pde->write_thru = (flags & PTE_WRITE_THROUGH) ? 1 : 0;
+    pde->cache_dis = (flags & PTE_CACHE_DISABLE) ? 1 : 0;
+    pde->large = 1;
+    pde->frame = phys_addr >> 12;
+    batch_pd_idx = 0xFFFFFFFF;
+    pde_changed(pd_idx);
+}
+
+// Replace a 4MB page with a page table holding the same 1024 mappings, so
+// that a single 4KB page inside it can be changed.
+static void split_large_page(uint32_t pd_idx) {
+    page_directory_entry_t* pde = &active_directory->tables[pd_idx];
+    uint32_t base = pde->frame << 12;
+    page_table_entry_t entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.present = 1;
+    entry.rw = pde->rw;
+    entry.user = pde->user;
+    entry.write_thru = pde->write_thru;
+    entry.cache_dis = pde->cache_dis;
+
+    if (pd_idx == 0) {
+        // The kernel runs from here, so the table must be complete before it
+        // goes live. The reserved first table is reachable through the 4MB page.
+        for (int i = 0; i < 1024; i++) {
+            first_page_table->pages[i] = entry;
+            first_page_table->pages[i].frame = (base >> 12) + i;
+        }
+        pde->large = 0;
+        pde->frame = (uint32_t)first_page_table >> 12;
+        pde_changed(pd_idx);
+        flush_tlb();
+        return;
+    }
+
+    uint32_t pt_phys = (uint32_t)pmm_alloc_block();
+    if (pt_phys == 0) {
+        print("PANIC: Out of physical memory for page table\n", 0x04);
+        for(;;);
+    }
+    pmm_set_owner((void*)pt_phys, 1, PAGE_OWNER_PAGE_TABLE);
+
+    // Nothing executes from this 4MB, so fill the table in place through the
+    // recursive mapping with interrupts held off.
+    uint32_t eflags;
+    asm volatile("pushf; pop %0; cli" : "=r"(eflags));
+    pde->large = 0;
+    pde->frame = pt_phys >> 12;
+    page_table_t* table = table_for(pd_idx);
+    invlpg((uint32_t)table);
+    for (int i = 0; i < 1024; i++) {
+        table->pages[i] = entry;
+        table->pages[i].frame = (base >> 12) + i;
+    }
+    pde_changed(pd_idx);
+    flush_tlb();
+    if (eflags & 0x200) {
+        asm volatile("sti");
+    }
+}
+
 // Page fault handler
 void page_fault_handler(regs_t *r) {
     uint32_t faulting_address;
     asm volatile("mov %%cr2, %0" : "=r" (faulting_address));
 
+    // Write to a shared copy-on-write page: give it a private copy
+    if (paging_handle_cow(faulting_address, r->err_code) == 0) {
+        return;
+    }
+
+    // First touch of a demand-paged area: back it and retry the access
+    if (vma_handle_fault(faulting_address, r->err_code) == 0) {
+        return;
+    }
+
     print("\nPANIC: PAGE FAULT\n", 0x04);
     print("  Faulting Address: ", 0x07);
     print_hex(faulting_address, 0x07);
@@ -30,20 +205,29 @@ void paging_install() {
     memset(page_directory, 0, sizeof(page_directory_t));
     memset(first_page_table, 0, sizeof(page_table_t));
 
-    // Identity map the first 4MB
-    for (int i = 0; i < 1024; i++) {
-        uint32_t physical_addr = i * 0x1000;
-        page_table_entry_t* pte = &first_page_table->pages[i];
-        pte->present = 1;
-        pte->rw = 1;
-        pte->frame = physical_addr >> 12;
-    }
+    // Identity map the first 4MB, with a single 4MB page when the CPU has PSE
+    if (cpu_has_pse()) {
+        uint32_t cr4;
+        asm volatile("mov %%cr4, %0" : "=r"(cr4));
+        cr4 |= 0x10; // Set PSE bit
+        asm volatile("mov %0, %%cr4" :: "r"(cr4));
+        pse_enabled = 1;
+        set_large_pde(0, 0, PTE_PRESENT | PTE_RW);
+    } else {
+        for (int i = 0; i < 1024; i++) {
+            uint32_t physical_addr = i * 0x1000;
+            page_table_entry_t* pte = &first_page_table->pages[i];
+            pte->present = 1;
+            pte->rw = 1;
+            pte->frame = physical_addr >> 12;
+        }
 
-    // Set the first entry in the page directory
-    page_directory_entry_t* pde = &page_directory->tables[0];
-    pde->present = 1;
-    pde->rw = 1;
-    pde->frame = (uint32_t)first_page_table >> 12;
+        // Set the first entry in the page directory
+        page_directory_entry_t* pde = &page_directory->tables[0];
+        pde->present = 1;
+        pde->rw = 1;
+        pde->frame = (uint32_t)first_page_table >> 12;
+    }
 
     // Add recursive mapping (map the last PDE to the page directory itself)
     page_directory->tables[1023].present = 1;
@@ -58,87 +242,147 @@ void paging_install() {
     uint32_t cr0;
     asm volatile("mov %%cr0, %0" : "=r"(cr0));
     cr0 |= 0x80000000; // Set PG bit
+    cr0 |= 0x10000;    // Set WP bit: without it ring 0 writes ignore read-only PTEs, so COW never faults
     asm volatile("mov %0, %%cr0" :: "r"(cr0));
+
+    active_directory = (page_directory_t*)0xFFFFF000;
 }
 
-void map_page(uint32_t phys_addr, uint32_t virt_addr, uint32_t flags) {
+static void create_page_table(uint32_t pd_idx) {
+    page_directory_entry_t* pde = &active_directory->tables[pd_idx];
+
+    // Allocate a new page table from physical memory
+    uint32_t new_pt_phys_addr = (uint32_t)pmm_alloc_block();
+    if (new_pt_phys_addr == 0) {
+        // Handle allocation failure (e.g., out of memory)
+        print("PANIC: Out of physical memory for page table\n", 0x04);
+        for(;;);
+    }
+    pmm_set_owner((void*)new_pt_phys_addr, 1, PAGE_OWNER_PAGE_TABLE);
+
+    // Map the new page table into the page directory
+    pde->present = 1;
+    pde->rw = 1; // Read/Write
+    pde->user = 1; // User-mode access
+    pde->frame = new_pt_phys_addr >> 12;
+
+    page_table_t* new_pt_virt = table_for(pd_idx);
+    memset(new_pt_virt, 0, sizeof(page_table_t));
+    pde_changed(pd_idx);
+}
+
+static void map_page_locked(uint32_t phys_addr, uint32_t virt_addr, uint32_t flags) {
     // Calculate page directory and page table indices
     uint32_t pd_idx = virt_addr >> 22;
     uint32_t pt_idx = (virt_addr >> 12) & 0x03FF;
 
     // Get the page directory entry
-    page_directory_entry_t* pde = &page_directory->tables[pd_idx];
-
-    // If the page directory entry is not present, create a new page table
-    if (!pde->present) {
-        // Allocate a new page table from physical memory
-        uint32_t new_pt_phys_addr = pmm_alloc_block();
-        if (new_pt_phys_addr == 0) {
-            // Handle allocation failure (e.g., out of memory)
-            print("PANIC: Out of physical memory for page table\n", 0x04);
-            for(;;);
+    page_directory_entry_t* pde = &active_directory->tables[pd_idx];
+
+    // Consecutive pages of a batch share the table checked for the first one
+    if (batch_depth == 0 || pd_idx != batch_pd_idx) {
+        if (pde->present && pde->large) {
+            // Already covered by a 4MB page: nothing to do if it maps the same
+            // frame, otherwise break it up into 4KB pages first.
+            uint32_t current = (pde->frame << 12) + (virt_addr & (LARGE_PAGE_SIZE - 1));
+            if (current == (phys_addr & ~0xFFF) && (flags & PTE_PRESENT) &&
+                pde->rw == ((flags & PTE_RW) ? 1 : 0) && pde->user == ((flags & PTE_USER) ? 1 : 0)) {
+                return;
+            }
+            split_large_page(pd_idx);
         }
 
-        // Map the new page table into the page directory
-        pde->present = 1;
-        pde->rw = 1; // Read/Write
-        pde->user = 1; // User-mode access
-        pde->frame = new_pt_phys_addr >> 12;
-
+        // If the page directory entry is not present, create a new page table
+        if (!pde->present) {
+            create_page_table(pd_idx);
+        }
 
-        page_table_t* new_pt_virt = (page_table_t*)(0xFFC00000 | (pd_idx << 12));
-        memset(new_pt_virt, 0, sizeof(page_table_t));
+        if (batch_depth > 0) {
+            batch_pd_idx = pd_idx;
+        }
     }
 
     // Get the page table using the recursive mapping
-    page_table_t* page_table = (page_table_t*)(0xFFC00000 | (pd_idx << 12));
+    page_table_t* page_table = table_for(pd_idx);
 
     // Get the page table entry
     page_table_entry_t* pte = &page_table->pages[pt_idx];
 
+    // The TLB never caches not-present entries, so a fresh mapping needs no flush
+    uint32_t was_present = pte->present;
+    paging_stats[batch_owner].pages++;
+
     // Set the page table entry
     pte->present = (flags & PTE_PRESENT) ? 1 : 0;
     pte->rw = (flags & PTE_RW) ? 1 : 0;
     pte->user = (flags & PTE_USER) ? 1 : 0;
+    pte->write_thru = (flags & PTE_WRITE_THROUGH) ? 1 : 0;
+    pte->cache_dis = (flags & PTE_CACHE_DISABLE) ? 1 : 0;
     pte->frame = phys_addr >> 12;
 
     // Invalidate TLB for the virtual address
-    asm volatile("invlpg (%0)" :: "r"(virt_addr) : "memory");
+    if (was_present) {
+        invalidate(virt_addr);
+    }
 }
 
-void unmap_page(uint32_t virt_addr) {
+static void unmap_page_locked(uint32_t virt_addr) {
     uint32_t pd_idx = virt_addr >> 22;
     uint32_t pt_idx = (virt_addr >> 12) & 0x03FF;
 
-    page_directory_entry_t* pde = &page_directory->tables[pd_idx];
+    page_directory_entry_t* pde = &active_directory->tables[pd_idx];
 
     if (!pde->present) {
         // Page directory entry not present, so page is not mapped
         return;
     }
+    if (pde->large) {
+        split_large_page(pd_idx);
+    }
 
-    page_table_t* page_table = (page_table_t*)(pde->frame << 12);
+    page_table_t* page_table = table_for(pd_idx);
     page_table_entry_t* pte = &page_table->pages[pt_idx];
 
+    if (!pte->present) {
+        return;
+    }
+
     // Clear the page table entry
     memset(pte, 0, sizeof(page_table_entry_t));
+    paging_stats[batch_owner].pages++;
 
     // Invalidate TLB for the virtual address
-    asm volatile("invlpg (%0)" :: "r"(virt_addr) : "memory");
+    invalidate(virt_addr);
+}
 
+// Page tables are shared by every kernel thread, so edits run with
+// interrupts off.
+void map_page(uint32_t phys_addr, uint32_t virt_addr, uint32_t flags) {
+    unsigned int irq = irq_save();
+    map_page_locked(phys_addr, virt_addr, flags);
+    irq_restore(irq);
+}
+
+void unmap_page(uint32_t virt_addr) {
+    unsigned int irq = irq_save();
+    unmap_page_locked(virt_addr);
+    irq_restore(irq);
 }
 
 uint32_t get_phys_addr(uint32_t virt_addr) {
     uint32_t pd_idx = virt_addr >> 22;
     uint32_t pt_idx = (virt_addr >> 12) & 0x03FF;
 
-    page_directory_entry_t* pde = &page_directory->tables[pd_idx];
+    page_directory_entry_t* pde = &active_directory->tables[pd_idx];
 
     if (!pde->present) {
         return 0; // Not mapped
     }
+    if (pde->large) {
+        return (pde->frame << 12) + (virt_addr & (LARGE_PAGE_SIZE - 1));
+    }
 
-    page_table_t* page_table = (page_table_t*)(0xFFC00000 | (pd_idx << 12));
+    page_table_t* page_table = table_for(pd_idx);
     page_table_entry_t* pte = &page_table->pages[pt_idx];
 
     if (!pte->present) {
@@ -147,4 +391,343 @@ uint32_t get_phys_addr(uint32_t virt_addr) {
 
     // Calculate physical address
     return (pte->frame << 12) + (virt_addr & 0xFFF);
-}
\ No newline at end of file
+}
+
+// Map [phys_addr, phys_addr + size) at virt_addr. Whole 4MB stretches where
+// both addresses are 4MB aligned use one large page each (if the CPU has
+// PSE and no page table is in the way); the rest uses 4KB pages. The user
+// half always gets 4KB pages: cloning and destroying an address space
+// expect a page table behind every user PDE.
+void map_range(uint32_t phys_addr, uint32_t virt_addr, uint32_t size, uint32_t flags) {
+    paging_batch_begin(batch_owner);
+    uint32_t offset = phys_addr & 0xFFF;
+    phys_addr -= offset;
+    virt_addr &= ~0xFFF;
+    size = (size + offset + 0xFFF) & ~0xFFF;
+
+    while (size > 0) {
+        uint32_t pd_idx = virt_addr >> 22;
+        page_directory_entry_t* pde = &active_directory->tables[pd_idx];
+        if (pse_enabled && size >= LARGE_PAGE_SIZE && !is_user_pde(pd_idx) &&
+            ((phys_addr | virt_addr) & (LARGE_PAGE_SIZE - 1)) == 0 &&
+            (!pde->present || pde->large)) {
+            set_large_pde(pd_idx, phys_addr, flags);
+            invalidate(virt_addr);
+            phys_addr += LARGE_PAGE_SIZE;
+            virt_addr += LARGE_PAGE_SIZE;
+            size -= LARGE_PAGE_SIZE;
+            continue;
+        }
+        map_page(phys_addr, virt_addr, flags);
+        phys_addr += 0x1000;
+        virt_addr += 0x1000;
+        size -= 0x1000;
+        if (virt_addr == 0) {
+            break; // Wrapped around the top of the address space
+        }
+    }
+    paging_batch_commit();
+}
+
+void paging_batch_begin(uint8_t owner) {
+    unsigned int irq = irq_save();
+    if (batch_depth++ > 0) {
+        return; // Nested: the outermost batch is charged for it
+    }
+    batch_irq_flags = irq;
+    batch_owner = owner < PAGE_OWNER_COUNT ? owner : PAGE_OWNER_KERNEL;
+    batch_count = 0;
+    batch_full_flush = 0;
+    batch_pd_idx = 0xFFFFFFFF;
+}
+
+void paging_batch_commit() {
+    if (batch_depth == 0) {
+        return;
+    }
+
+    // Nested commits flush too, so that e.g. the heap can reuse a virtual
+    // page it just unmapped while an outer batch is still open.
+    if (batch_full_flush) {
+        flush_tlb();
+    } else {
+        for (uint32_t i = 0; i < batch_count; i++) {
+            invlpg(batch_pending[i]);
+        }
+    }
+    batch_count = 0;
+    batch_full_flush = 0;
+
+    if (--batch_depth == 0) {
+        paging_stats[batch_owner].batches++;
+        batch_owner = PAGE_OWNER_KERNEL;
+        batch_pd_idx = 0xFFFFFFFF;
+        irq_restore(batch_irq_flags);
+    }
+}
+
+const paging_stats_t* paging_get_stats(uint8_t owner) {
+    return owner < PAGE_OWNER_COUNT ? &paging_stats[owner] : 0;
+}
+
+// Point the foreign slot at another directory (0 detaches it)
+static void attach_foreign(uint32_t pd_phys) {
+    page_directory_entry_t* pde = &active_directory->tables[FOREIGN_PDE];
+    memset(pde, 0, sizeof(page_directory_entry_t));
+    if (pd_phys != 0) {
+        pde->present = 1;
+        pde->rw = 1;
+        pde->frame = pd_phys >> 12;
+    }
+    flush_tlb(); // Drop translations left over from the previous foreign space
+}
+
+// Copy the kernel PDEs from the master directory into the foreign one
+static void sync_kernel_pdes(address_space_t* space) {
+    page_directory_t* dir = FOREIGN_DIRECTORY;
+    for (uint32_t pd_idx = 0; pd_idx < FOREIGN_PDE; pd_idx++) {
+        if (is_kernel_pde(pd_idx)) {
+            dir->tables[pd_idx] = page_directory->tables[pd_idx];
+        }
+    }
+    space->kernel_generation = kernel_pde_generation;
+}
+
+static void destroy_space_locked(address_space_t* space);
+
+static void* alloc_table_frame() {
+    void* frame = pmm_alloc_block();
+    if (frame != 0) {
+        pmm_set_owner(frame, 1, PAGE_OWNER_PAGE_TABLE);
+    }
+    return frame;
+}
+
+// A new address space: the shared kernel half and an empty user half
+static address_space_t* create_space_locked() {
+    address_space_t* space = kmalloc(sizeof(address_space_t));
+    if (space == 0) {
+        return 0;
+    }
+    void* dir_frame = alloc_table_frame();
+    if (dir_frame == 0) {
+        kfree(space);
+        return 0;
+    }
+    space->pd_phys = (uint32_t)dir_frame;
+
+    attach_foreign(space->pd_phys);
+    page_directory_t* dir = FOREIGN_DIRECTORY;
+    memset(dir, 0, sizeof(page_directory_t));
+    sync_kernel_pdes(space);
+    dir->tables[1023].present = 1;
+    dir->tables[1023].rw = 1;
+    dir->tables[1023].frame = space->pd_phys >> 12;
+    attach_foreign(0);
+    return space;
+}
+
+// Clone the current address space. User pages are not copied: both sides
+// map the same frames read-only with PTE_COW set, and the first write on
+// either side takes a private copy (see paging_handle_cow).
+static address_space_t* clone_space_locked() {
+    address_space_t* child = create_space_locked();
+    if (child == 0) {
+        return 0;
+    }
+
+    attach_foreign(child->pd_phys);
+    page_directory_t* child_dir = FOREIGN_DIRECTORY;
+    for (uint32_t pd_idx = USER_SPACE_START >> 22; pd_idx < USER_SPACE_END >> 22; pd_idx++) {
+        page_directory_entry_t* pde = &active_directory->tables[pd_idx];
+        if (!pde->present) {
+            continue;
+        }
+
+        void* table_frame = alloc_table_frame();
+        if (table_frame == 0) {
+            attach_foreign(0);
+            destroy_space_locked(child);
+            return 0;
+        }
+        child_dir->tables[pd_idx] = *pde;
+        child_dir->tables[pd_idx].frame = (uint32_t)table_frame >> 12;
+
+        page_table_t* parent_table = table_for(pd_idx);
+        page_table_t* child_table = foreign_table_for(pd_idx);
+        asm volatile("invlpg (%0)" :: "r"(child_table) : "memory");
+        for (int i = 0; i < 1024; i++) {
+            page_table_entry_t* pte = &parent_table->pages[i];
+            if (pte->present) {
+                if (pte->rw) {
+                    pte->rw = 0;
+                    pte->cow = 1;
+                }
+                pmm_get((void*)(pte->frame << 12));
+            }
+            child_table->pages[i] = *pte;
+        }
+    }
+    attach_foreign(0); // Also flushes the parent's now read-only entries
+    return child;
+}
+
+// Free an address space's user half, its page tables and its directory.
+// The kernel half is shared and stays.
+static void destroy_space_locked(address_space_t* space) {
+    if (space == 0 || space == &kernel_space || space == current_space) {
+        return;
+    }
+
+    attach_foreign(space->pd_phys);
+    page_directory_t* dir = FOREIGN_DIRECTORY;
+    for (uint32_t pd_idx = USER_SPACE_START >> 22; pd_idx < USER_SPACE_END >> 22; pd_idx++) {
+        if (!dir->tables[pd_idx].present) {
+            continue;
+        }
+        page_table_t* table = foreign_table_for(pd_idx);
+        for (int i = 0; i < 1024; i++) {
+            if (table->pages[i].present) {
+                pmm_put((void*)(table->pages[i].frame << 12));
+            }
+        }
+        pmm_put((void*)(dir->tables[pd_idx].frame << 12));
+    }
+    attach_foreign(0);
+
+    pmm_put((void*)space->pd_phys);
+    kfree(space);
+}
+
+static void switch_space_locked(address_space_t* space) {
+    if (space == current_space) {
+        return;
+    }
+    if (space->kernel_generation != kernel_pde_generation) {
+        attach_foreign(space->pd_phys);
+        sync_kernel_pdes(space);
+        attach_foreign(0);
+    }
+    current_space = space;
+    asm volatile("mov %0, %%cr3" :: "r"(space->pd_phys) : "memory");
+    paging_stats[batch_owner].full_flushes++;
+}
+
+// The foreign slot is a single shared window, so address space operations
+// run with interrupts off.
+address_space_t* paging_create_address_space() {
+    unsigned int irq = irq_save();
+    address_space_t* space = create_space_locked();
+    irq_restore(irq);
+    return space;
+}
+
+address_space_t* paging_clone_address_space() {
+    unsigned int irq = irq_save();
+    address_space_t* child = clone_space_locked();
+    irq_restore(irq);
+    return child;
+}
+
+void paging_destroy_address_space(address_space_t* space) {
+    unsigned int irq = irq_save();
+    destroy_space_locked(space);
+    irq_restore(irq);
+}
+
+void paging_switch(address_space_t* space) {
+    unsigned int irq = irq_save();
+    switch_space_locked(space);
+    irq_restore(irq);
+}
+
+address_space_t* paging_current_address_space() {
+    return current_space;
+}
+
+address_space_t* paging_kernel_address_space() {
+    return &kernel_space;
+}
+
+// Resolve a write fault on a PTE_COW page. The last sharer just gets write
+// access back, everyone else copies the page into a fresh frame.
+int paging_handle_cow(uint32_t virt_addr, uint32_t err_code) {
+    if ((err_code & 0x3) != 0x3) {
+        return -1; // Only write faults on present pages
+    }
+    uint32_t pd_idx = virt_addr >> 22;
+    page_directory_entry_t* pde = &active_directory->tables[pd_idx];
+    if (!pde->present || pde->large) {
+        return -1;
+    }
+    page_table_entry_t* pte = &table_for(pd_idx)->pages[(virt_addr >> 12) & 0x03FF];
+    if (!pte->present || !pte->cow) {
+        return -1;
+    }
+
+    uint32_t page = virt_addr & ~0xFFF;
+    uint32_t old_frame = pte->frame << 12;
+    page_t* info = pmm_page((void*)old_frame);
+    if (info != 0 && info->refcount == 1) {
+        pte->rw = 1;
+        pte->cow = 0;
+        invlpg(page);
+        return 0;
+    }
+
+    void* new_frame = pmm_alloc_block();
+    if (new_frame == 0) {
+        return -2; // Out of physical memory
+    }
+    if (info != 0) {
+        pmm_set_owner(new_frame, 1, info->owner);
+    }
+    memcpy(cow_buffer, (void*)page, sizeof(cow_buffer));
+    pte->frame = (uint32_t)new_frame >> 12;
+    pte->rw = 1;
+    pte->cow = 0;
+    invlpg(page);
+    memcpy((void*)page, cow_buffer, sizeof(cow_buffer));
+    pmm_put((void*)old_frame);
+    return 0;
+}
+
+// Boot-time check that copy-on-write works: a write after a clone has to
+// fault, land in a fresh frame, and leave the parent's frame untouched.
+int paging_cow_check() {
+    const uint32_t va = USER_SPACE_START;
+    volatile uint8_t* p = (volatile uint8_t*)va;
+    address_space_t* prev = current_space;
+    address_space_t* parent = paging_create_address_space();
+    void* frame = pmm_alloc_block();
+    if (parent == 0 || frame == 0) {
+        if (frame) {
+            pmm_put(frame);
+        }
+        paging_destroy_address_space(parent);
+        return -2; // Out of memory, nothing checked
+    }
+
+    paging_switch(parent);
+    map_page((uint32_t)frame, va, PTE_PRESENT | PTE_RW);
+    *p = 0xA5;
+
+    int result = -1;
+    address_space_t* child = paging_clone_address_space();
+    if (child != 0) {
+        paging_switch(child);
+        *p = 0x5A;
+        uint32_t child_frame = get_phys_addr(va);
+        int child_ok = *p == 0x5A;
+        paging_switch(parent);
+        if (child_ok && child_frame != (uint32_t)frame
+                && get_phys_addr(va) == (uint32_t)frame && *p == 0xA5) {
+            result = 0;
+        }
+    }
+
+    paging_switch(prev);
+    paging_destroy_address_space(child); // Frees the frames too
+    paging_destroy_address_space(parent);
+    return result;
+}
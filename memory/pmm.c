@@ -1,48 +1,231 @@
 #include "include/pmm.h"
 #include "include/memcore.h"
+#include "include/cpu.h"
 
 #define BLOCK_SIZE 4096
 #define BLOCKS_PER_BYTE 8
+#define BLOCKS_PER_WORD 32
 
+// Physical frames are handed out by a binary buddy allocator: a free block
+// of order k is 2^k frames, aligned to 2^k, and sits on free_lists[k].
+// Allocation splits larger blocks, freeing merges a block with its buddy
+// (the neighbouring block of the same order) whenever both are free.
+//
+// The two-level bitmap mirrors which frames are in use. pmm_bitmap has one
+// bit per block (1 = used), and pmm_summary has one bit per bitmap word, set
+// while that word is full. It is used for accounting, double-free checks
+// and for finding free runs quickly when the free lists are built.
+//
+// Every exported mutator runs with interrupts off so kernel threads can
+// allocate and free frames without tearing the lists.
 static uint32_t* pmm_bitmap = 0;
+static uint32_t* pmm_summary = 0;
+static uint32_t bitmap_words = 0;
+static uint32_t summary_words = 0;
 static uint32_t total_blocks = 0;
 static uint32_t used_blocks = 0;
+static e820_entry_t* e820_map = 0;
+static uint32_t e820_entries = 0;
+
+// Page frame database. Free lists are linked through it rather than through
+// the free frames themselves because most of RAM is not mapped.
+#define PMM_NO_FRAME 0xFFFFFFFF
+
+static page_t* frames = 0;
+static uint32_t free_lists[PMM_MAX_ORDER + 1];
+static uint32_t free_counts[PMM_MAX_ORDER + 1];
+static uint32_t owner_blocks[PAGE_OWNER_COUNT];
+
+// Everything the PMM keeps after the kernel must stay inside the identity
+// mapped area below the heap window; memory past that is left unmanaged.
+#define PMM_METADATA_LIMIT 0x400000
 
 extern uint32_t _kernel_end;
 
+// Index of the lowest clear bit (word must not be all ones)
+static inline uint32_t first_zero_bit(uint32_t word) {
+    return __builtin_ctz(~word);
+}
+
 // Helper to set a bit in the bitmap
 void set_block(uint32_t bit) {
-    pmm_bitmap[bit / 32] |= (1 << (bit % 32));
+    uint32_t word = bit / BLOCKS_PER_WORD;
+    pmm_bitmap[word] |= (1 << (bit % BLOCKS_PER_WORD));
+    if (pmm_bitmap[word] == 0xFFFFFFFF) {
+        pmm_summary[word / 32] |= (1 << (word % 32));
+    }
 }
 
 // Helper to clear a bit in the bitmap
 void clear_block(uint32_t bit) {
-    pmm_bitmap[bit / 32] &= ~(1 << (bit % 32));
+    uint32_t word = bit / BLOCKS_PER_WORD;
+    pmm_bitmap[word] &= ~(1 << (bit % BLOCKS_PER_WORD));
+    pmm_summary[word / 32] &= ~(1 << (word % 32));
 }
 
 // Helper to test a bit in the bitmap
 uint32_t test_block(uint32_t bit) {
-    return pmm_bitmap[bit / 32] & (1 << (bit % 32));
+    return pmm_bitmap[bit / BLOCKS_PER_WORD] & (1 << (bit % BLOCKS_PER_WORD));
 }
 
-// Helper to find the first free block
-int32_t find_first_free() {
-    for (uint32_t i = 0; i < total_blocks / 32; i++) {
-        if (pmm_bitmap[i] != 0xFFFFFFFF) {
-            for (int j = 0; j < 32; j++) {
-                if (!(pmm_bitmap[i] & (1 << j))) {
-                    return i * 32 + j;
-                }
-            }
+// Find the first bitmap word at or after `word` that has a free block
+static int32_t find_free_word(uint32_t word) {
+    while (word < bitmap_words) {
+        uint32_t sword = word / 32;
+        // Ignore summary bits for words before the starting point
+        uint32_t full = pmm_summary[sword] | ((1 << (word % 32)) - 1);
+        if (full != 0xFFFFFFFF) {
+            return sword * 32 + first_zero_bit(full);
         }
+        word = (sword + 1) * 32;
     }
     return -1;
 }
 
+// Find the first free block at or after `bit`
+static int32_t find_free_from(uint32_t bit) {
+    uint32_t word = bit / BLOCKS_PER_WORD;
+    if (word >= bitmap_words) {
+        return -1;
+    }
+
+    // The first word may be partially behind us
+    uint32_t masked = pmm_bitmap[word] | ((1 << (bit % BLOCKS_PER_WORD)) - 1);
+    if (masked != 0xFFFFFFFF) {
+        return word * BLOCKS_PER_WORD + first_zero_bit(masked);
+    }
+
+    int32_t free_word = find_free_word(word + 1);
+    if (free_word < 0) {
+        return -1;
+    }
+    return free_word * BLOCKS_PER_WORD + first_zero_bit(pmm_bitmap[free_word]);
+}
+
+// Find the first used block at or after `bit` (total_blocks if none)
+static uint32_t find_used_from(uint32_t bit) {
+    while (bit < total_blocks) {
+        uint32_t word = pmm_bitmap[bit / BLOCKS_PER_WORD] >> (bit % BLOCKS_PER_WORD);
+        if (word != 0) {
+            bit += __builtin_ctz(word);
+            break;
+        }
+        bit = (bit / BLOCKS_PER_WORD + 1) * BLOCKS_PER_WORD;
+    }
+    return bit < total_blocks ? bit : total_blocks;
+}
+
+static void free_list_push(uint32_t frame, uint32_t order) {
+    frames[frame].order = order;
+    frames[frame].flags |= PAGE_FREE;
+    frames[frame].prev = PMM_NO_FRAME;
+    frames[frame].next = free_lists[order];
+    if (free_lists[order] != PMM_NO_FRAME) {
+        frames[free_lists[order]].prev = frame;
+    }
+    free_lists[order] = frame;
+    free_counts[order]++;
+}
+
+static void free_list_remove(uint32_t frame, uint32_t order) {
+    page_t* f = &frames[frame];
+    if (f->prev != PMM_NO_FRAME) {
+        frames[f->prev].next = f->next;
+    } else {
+        free_lists[order] = f->next;
+    }
+    if (f->next != PMM_NO_FRAME) {
+        frames[f->next].prev = f->prev;
+    }
+    f->flags &= ~PAGE_FREE;
+    free_counts[order]--;
+}
+
+// Take a block of 2^order frames off the free lists, splitting if needed
+static int32_t buddy_alloc(uint32_t order) {
+    uint32_t current = order;
+    while (current <= PMM_MAX_ORDER && free_lists[current] == PMM_NO_FRAME) {
+        current++;
+    }
+    if (current > PMM_MAX_ORDER) {
+        return -1;
+    }
+
+    uint32_t frame = free_lists[current];
+    free_list_remove(frame, current);
+
+    // Hand the upper halves back until the block is the requested size
+    while (current > order) {
+        current--;
+        free_list_push(frame + (1 << current), current);
+    }
+
+    frames[frame].order = order;
+    for (uint32_t i = 0; i < (1u << order); i++) {
+        set_block(frame + i);
+        frames[frame + i].refcount = 1;
+        frames[frame + i].owner = PAGE_OWNER_KERNEL;
+    }
+    used_blocks += 1 << order;
+    owner_blocks[PAGE_OWNER_KERNEL] += 1 << order;
+    return frame;
+}
+
+// Return a block of 2^order frames and merge it with free buddies
+static void buddy_free(uint32_t frame, uint32_t order) {
+    for (uint32_t i = 0; i < (1u << order); i++) {
+        clear_block(frame + i);
+        if (frames[frame + i].owner != PAGE_OWNER_NONE) {
+            owner_blocks[frames[frame + i].owner]--;
+        }
+        frames[frame + i].refcount = 0;
+        frames[frame + i].owner = PAGE_OWNER_NONE;
+    }
+    used_blocks -= 1 << order;
+
+    while (order < PMM_MAX_ORDER) {
+        uint32_t buddy = frame ^ (1 << order);
+        if (buddy >= total_blocks || !(frames[buddy].flags & PAGE_FREE) ||
+            frames[buddy].order != order) {
+            break;
+        }
+        free_list_remove(buddy, order);
+        if (buddy < frame) {
+            frame = buddy;
+        }
+        order++;
+    }
+    free_list_push(frame, order);
+}
+
+// Largest order whose block starts at `frame` and fits in `count` frames
+static uint32_t largest_order(uint32_t frame, uint32_t count) {
+    uint32_t order = 0;
+    while (order < PMM_MAX_ORDER &&
+           (frame & ((2u << order) - 1)) == 0 &&
+           (2u << order) <= count) {
+        order++;
+    }
+    return order;
+}
+
+// Free an arbitrary run of used frames as a series of aligned buddy blocks
+static void free_range(uint32_t frame, uint32_t count) {
+    while (count > 0) {
+        uint32_t order = largest_order(frame, count);
+        buddy_free(frame, order);
+        frame += 1 << order;
+        count -= 1 << order;
+    }
+}
+
 void pmm_init(uint32_t mmap_addr, uint32_t mmap_entries) {
     e820_entry_t* mmap = (e820_entry_t*)mmap_addr;
     uint64_t total_mem = 0;
 
+    e820_map = mmap;
+    e820_entries = mmap_entries;
+
     for (uint32_t i = 0; i < mmap_entries; i++) {
         if (mmap[i].type == 1) { // Usable RAM
             if (mmap[i].base + mmap[i].len > total_mem) {
@@ -51,58 +234,192 @@ void pmm_init(uint32_t mmap_addr, uint32_t mmap_entries) {
         }
     }
 
+    // Size the metadata, trimming the managed range until it fits
+    uint32_t metadata_start = (uint32_t)&_kernel_end;
+    uint32_t metadata_size;
     total_blocks = total_mem / BLOCK_SIZE;
-    pmm_bitmap = (uint32_t*)&_kernel_end;
-    uint32_t bitmap_size = total_blocks / BLOCKS_PER_BYTE;
+    for (;;) {
+        bitmap_words = (total_blocks + BLOCKS_PER_WORD - 1) / BLOCKS_PER_WORD;
+        summary_words = (bitmap_words + 31) / 32;
+        metadata_size = (bitmap_words + summary_words) * sizeof(uint32_t) + total_blocks * sizeof(page_t);
+        if (metadata_start + metadata_size <= PMM_METADATA_LIMIT) {
+            break;
+        }
+        total_blocks -= (metadata_start + metadata_size - PMM_METADATA_LIMIT) / sizeof(page_t) + 1;
+    }
+
+    pmm_bitmap = (uint32_t*)metadata_start;
+    pmm_summary = pmm_bitmap + bitmap_words;
+    frames = (page_t*)(pmm_summary + summary_words);
+    uint32_t bitmap_size = (bitmap_words + summary_words) * sizeof(uint32_t);
 
-    // Mark all memory as used initially
+    // Mark all memory as used initially (including the padding bits past
+    // total_blocks in the last word, so they are never handed out)
     memset(pmm_bitmap, 0xFF, bitmap_size);
+    memset(frames, 0, total_blocks * sizeof(page_t));
     used_blocks = total_blocks;
 
-    // Free the usable memory regions
+    // Free the usable memory regions, only whole blocks
     for (uint32_t i = 0; i < mmap_entries; i++) {
         if (mmap[i].type == 1) { // Usable RAM
-            uint64_t base = mmap[i].base;
-            uint64_t len = mmap[i].len;
-            for (uint64_t j = 0; j < len; j += BLOCK_SIZE) {
-                clear_block((base + j) / BLOCK_SIZE);
-                used_blocks--;
+            uint64_t first = (mmap[i].base + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            uint64_t last = (mmap[i].base + mmap[i].len) / BLOCK_SIZE;
+            if (last > total_blocks) {
+                last = total_blocks;
+            }
+            for (uint64_t block = first; block < last; block++) {
+                if (test_block(block)) {
+                    clear_block(block);
+                    used_blocks--;
+                }
             }
         }
     }
 
-    // Mark kernel and bitmap as used
-    uint32_t kernel_and_bitmap_blocks = ((uint32_t)&_kernel_end + bitmap_size) / BLOCK_SIZE;
-    for (uint32_t i = 0; i < kernel_and_bitmap_blocks; i++) {
+    // Mark kernel and PMM metadata as used
+    uint32_t kernel_and_bitmap_blocks = (metadata_start + metadata_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for (uint32_t i = 0; i < PAGE_OWNER_COUNT; i++) {
+        owner_blocks[i] = 0;
+    }
+    for (uint32_t i = 0; i < kernel_and_bitmap_blocks && i < total_blocks; i++) {
         if (!test_block(i)) {
             set_block(i);
             used_blocks++;
         }
+        frames[i].refcount = 1;
+        frames[i].owner = PAGE_OWNER_KERNEL;
+        frames[i].flags = PAGE_RESERVED;
+        owner_blocks[PAGE_OWNER_KERNEL]++;
+    }
+
+    // Build the free lists from the runs of free blocks. free_range()
+    // expects used frames, so flip each run back to used first.
+    for (uint32_t order = 0; order <= PMM_MAX_ORDER; order++) {
+        free_lists[order] = PMM_NO_FRAME;
+        free_counts[order] = 0;
+    }
+    int32_t run_start = find_free_from(0);
+    while (run_start >= 0 && (uint32_t)run_start < total_blocks) {
+        uint32_t run_end = find_used_from(run_start);
+        for (uint32_t block = run_start; block < run_end; block++) {
+            set_block(block);
+        }
+        used_blocks += run_end - run_start;
+        free_range(run_start, run_end - run_start);
+        run_start = find_free_from(run_end);
+    }
+}
+
+void* pmm_alloc_order(uint32_t order) {
+    if (order > PMM_MAX_ORDER) {
+        return 0;
+    }
+    unsigned int flags = irq_save();
+    int32_t frame = buddy_alloc(order);
+    irq_restore(flags);
+    if (frame < 0) {
+        return 0; // Out of memory, or too fragmented for this order
     }
+    return (void*)(frame * BLOCK_SIZE);
+}
+
+void pmm_free_order(void* block, uint32_t order) {
+    uint32_t frame = (uint32_t)block / BLOCK_SIZE;
+    unsigned int flags = irq_save();
+    if (order <= PMM_MAX_ORDER && frame + (1 << order) <= total_blocks && test_block(frame) &&
+        !(frames[frame].flags & PAGE_RESERVED)) {
+        buddy_free(frame, order);
+    }
+    irq_restore(flags);
 }
 
 void* pmm_alloc_block() {
-    if (used_blocks >= total_blocks) {
-        return 0; // Out of memory
+    return pmm_alloc_order(0);
+}
+
+void* pmm_alloc_blocks(uint32_t count, uint32_t align) {
+    if (count == 0) {
+        return 0;
     }
 
-    int32_t frame = find_first_free();
-    if (frame == -1) {
-        return 0; // Should not happen if used_blocks is correct
+    // Buddy blocks are aligned to their own size, so round both up to one order
+    uint32_t order = 0;
+    while ((1u << order) < count || (1u << order) < align) {
+        order++;
     }
 
-    set_block(frame);
-    used_blocks++;
-    return (void*)(frame * BLOCK_SIZE);
+    unsigned int flags = irq_save();
+    void* block = pmm_alloc_order(order);
+
+    // Give back the tail we don't need
+    uint32_t frame = (uint32_t)block / BLOCK_SIZE;
+    if (block != 0 && (1u << order) > count) {
+        free_range(frame + count, (1 << order) - count);
+    }
+    irq_restore(flags);
+    return block;
 }
 
 void pmm_free_block(void* block) {
+    pmm_put(block);
+}
+
+void pmm_free_blocks(void* block, uint32_t count) {
     uint32_t frame = (uint32_t)block / BLOCK_SIZE;
-    if (test_block(frame)) {
-        clear_block(frame);
-        used_blocks--;
+    for (uint32_t i = 0; i < count; i++) {
+        pmm_put((void*)((frame + i) * BLOCK_SIZE));
     }
 }
+
+page_t* pmm_page(void* block) {
+    uint32_t frame = (uint32_t)block / BLOCK_SIZE;
+    if (frame >= total_blocks) {
+        return 0;
+    }
+    return &frames[frame];
+}
+
+void pmm_get(void* block) {
+    uint32_t frame = (uint32_t)block / BLOCK_SIZE;
+    unsigned int flags = irq_save();
+    if (frame < total_blocks && test_block(frame) && frames[frame].owner != PAGE_OWNER_NONE) {
+        frames[frame].refcount++;
+    }
+    irq_restore(flags);
+}
+
+void pmm_put(void* block) {
+    uint32_t frame = (uint32_t)block / BLOCK_SIZE;
+    unsigned int flags = irq_save();
+    // Skip frames that are not allocated (or a double free), or never freeable
+    if (frame < total_blocks && test_block(frame) && frames[frame].refcount != 0 &&
+        !(frames[frame].flags & PAGE_RESERVED) && --frames[frame].refcount == 0) {
+        buddy_free(frame, 0);
+    }
+    irq_restore(flags);
+}
+
+void pmm_set_owner(void* block, uint32_t count, uint8_t owner) {
+    uint32_t frame = (uint32_t)block / BLOCK_SIZE;
+    if (owner == PAGE_OWNER_NONE || owner >= PAGE_OWNER_COUNT) {
+        return;
+    }
+    unsigned int flags = irq_save();
+    for (uint32_t i = frame; i < frame + count && i < total_blocks; i++) {
+        if (frames[i].refcount == 0 || (frames[i].flags & PAGE_RESERVED)) {
+            continue;
+        }
+        owner_blocks[frames[i].owner]--;
+        owner_blocks[owner]++;
+        frames[i].owner = owner;
+    }
+    irq_restore(flags);
+}
+
+uint32_t pmm_get_owner_blocks(uint8_t owner) {
+    return owner < PAGE_OWNER_COUNT ? owner_blocks[owner] : 0;
+}
+
 uint32_t pmm_get_total_memory() {
     return total_blocks * BLOCK_SIZE;
 }
@@ -114,3 +431,12 @@ uint32_t pmm_get_used_memory() {
 uint32_t pmm_get_free_memory() {
     return (total_blocks - used_blocks) * BLOCK_SIZE;
 }
+
+uint32_t pmm_get_free_list_depth(uint32_t order) {
+    return order <= PMM_MAX_ORDER ? free_counts[order] : 0;
+}
+
+uint32_t pmm_get_memory_map(const e820_entry_t** map) {
+    *map = e820_map;
+    return e820_entries;
+}
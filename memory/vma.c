@@ -0,0 +1,150 @@
+#include "include/vma.h"
+#include "include/paging.h"
+#include "include/memcore.h"
+#include "include/cpu.h"
+
+#define VMA_PAGE_SIZE 4096
+
+// Page fault error code bits
+#define PF_PRESENT 0x1 // Protection violation rather than a missing page
+#define PF_WRITE   0x2
+
+// Areas sorted by start address. An unmapped guard page is kept between
+// neighbours, so running off the end of one faults instead of landing in
+// the next.
+static vma_t areas[VMA_MAX_AREAS];
+static uint32_t area_count = 0;
+
+vma_t* vma_find(uint32_t addr) {
+    for (uint32_t i = 0; i < area_count; i++) {
+        if (addr < areas[i].start) {
+            break;
+        }
+        if (addr < areas[i].end) {
+            return &areas[i];
+        }
+    }
+    return 0;
+}
+
+// Reserve `size` bytes of the window. Nothing is backed until it is touched.
+static void* alloc_locked(uint32_t size, uint32_t flags, uint8_t owner, const char* name) {
+    if (size == 0 || area_count == VMA_MAX_AREAS) {
+        return 0;
+    }
+    size = (size + VMA_PAGE_SIZE - 1) & ~(VMA_PAGE_SIZE - 1);
+
+    // First fit over the gaps between areas
+    uint32_t start = VMA_WINDOW_START;
+    uint32_t slot = 0;
+    for (; slot < area_count; slot++) {
+        if (areas[slot].start >= start && areas[slot].start - start >= size + VMA_PAGE_SIZE) {
+            break;
+        }
+        start = areas[slot].end + VMA_PAGE_SIZE;
+    }
+    if (start > VMA_WINDOW_END || VMA_WINDOW_END - start < size) {
+        return 0; // Window exhausted
+    }
+
+    for (uint32_t i = area_count; i > slot; i--) {
+        areas[i] = areas[i - 1];
+    }
+    vma_t* area = &areas[slot];
+    area->start = start;
+    area->end = start + size;
+    area->flags = flags;
+    area->owner = owner;
+    area->resident = 0;
+    area->faults = 0;
+    area->name = name;
+    area_count++;
+    return (void*)start;
+}
+
+// Drop an area and give back every frame that was faulted in
+static int free_locked(void* start) {
+    uint32_t addr = (uint32_t)start;
+    uint32_t slot = 0;
+    while (slot < area_count && areas[slot].start != addr) {
+        slot++;
+    }
+    if (slot == area_count) {
+        return -1; // Not the start of an area
+    }
+
+    paging_batch_begin(areas[slot].owner);
+    for (uint32_t page = areas[slot].start; page < areas[slot].end; page += VMA_PAGE_SIZE) {
+        uint32_t phys = get_phys_addr(page);
+        if (phys != 0) {
+            unmap_page(page);
+            pmm_put((void*)phys);
+        }
+    }
+    paging_batch_commit();
+
+    for (uint32_t i = slot; i + 1 < area_count; i++) {
+        areas[i] = areas[i + 1];
+    }
+    area_count--;
+    return 0;
+}
+
+// The public entry points run with interrupts off: the area list is shared
+// by every kernel thread.
+void* vma_alloc(uint32_t size, uint32_t flags, uint8_t owner, const char* name) {
+    unsigned int irq = irq_save();
+    void* area = alloc_locked(size, flags, owner, name);
+    irq_restore(irq);
+    return area;
+}
+
+int vma_free(void* start) {
+    unsigned int irq = irq_save();
+    int result = free_locked(start);
+    irq_restore(irq);
+    return result;
+}
+
+// Called from the page fault handler. Returns 0 if the fault was a first
+// touch inside an area and has been satisfied with a zeroed frame.
+int vma_handle_fault(uint32_t addr, uint32_t err_code) {
+    vma_t* area = vma_find(addr);
+    if (area == 0 || (err_code & PF_PRESENT)) {
+        return -1;
+    }
+    if ((err_code & PF_WRITE) && !(area->flags & VMA_WRITE)) {
+        return -1;
+    }
+
+    void* frame = pmm_alloc_block();
+    if (frame == 0) {
+        return -2; // Out of physical memory
+    }
+    pmm_set_owner(frame, 1, area->owner);
+
+    uint32_t page = addr & ~(VMA_PAGE_SIZE - 1);
+    uint32_t flags = PTE_PRESENT;
+    if (area->flags & VMA_WRITE) {
+        flags |= PTE_RW;
+    }
+    if (area->flags & VMA_USER) {
+        flags |= PTE_USER;
+    }
+    // Zero through a writable mapping first: with CR0.WP even the kernel
+    // can't write a read-only page
+    map_page((uint32_t)frame, page, flags | PTE_RW);
+    memset((void*)page, 0, VMA_PAGE_SIZE);
+    if (!(flags & PTE_RW)) {
+        map_page((uint32_t)frame, page, flags);
+    }
+
+    area->resident++;
+    area->faults++;
+    return 0;
+}
+
+uint32_t vma_get_areas(const vma_t** list) {
+    *list = areas;
+    return area_count;
+}
@@ -4,6 +4,7 @@
 #include "../include/memcore.h"
 #include "../include/heap.h"
 #include "../include/pmm.h"
+#include "../include/klog.h"
 
 #define E1000_RDBAL 0x2800
 #define E1000_RDBAH 0x2804
@@ -41,30 +42,32 @@ bool e1000_init(uint8_t bus, uint8_t dev, uint8_t func) {
     if (bar0_raw & 1) return false;
 
     uint32_t mmio_base = bar0_raw & 0xFFFFFFF0;
-    // Map a larger region for MMIO
-    for (uint32_t i = 0; i < 0x10000; i += 0x1000) {
-        map_page(mmio_base + i, mmio_base + i, PTE_PRESENT | PTE_RW);
-    }
+    // Map a larger region for MMIO, uncached
+    map_range(mmio_base, mmio_base, 0x10000, PTE_PRESENT | PTE_RW | PTE_CACHE_DISABLE);
     e1000_regs = (volatile uint32_t*)mmio_base;
 
-    print("E1000 MMIO Base: ", 0x07);
-    print_hex(mmio_base, 0x07);
-    print("\n", 0x07);
+    klog("E1000", "MMIO Base: 0x%08X", mmio_base);
 
     uint32_t status = e1000_regs[2];
-    print("E1000 Status: ", 0x07);
-    print_hex(status, 0x07);
-    print("\n", 0x07);
+    klog("E1000", "Status: 0x%08X", status);
 
     // RX Ring Setup
     rx_ring = alloc_aligned(sizeof(struct e1000_rx_desc) * RX_DESC_COUNT, 16);
+    // Packet buffers are whole heap pages; each one is physically contiguous.
+    // Map them all under one batch so the TLB is flushed once.
+    paging_batch_begin(PAGE_OWNER_NIC);
     for (int i = 0; i < RX_DESC_COUNT; ++i) {
-        void* phys_addr = pmm_alloc_block();
-        rx_buffers[i] = kmalloc(4096); // Allocate virtual space
-        map_page((uint32_t)phys_addr, (uint32_t)rx_buffers[i], PTE_PRESENT | PTE_RW);
+        rx_buffers[i] = alloc_aligned(4096, 4096);
+        if (!rx_buffers[i]) {
+            paging_batch_commit();
+            return false;
+        }
+        uint32_t phys_addr = get_phys_addr((uint32_t)rx_buffers[i]);
+        pmm_set_owner((void*)phys_addr, 1, PAGE_OWNER_NIC);
         rx_ring[i].addr = (uint64_t)phys_addr;
         rx_ring[i].status = 0;
     }
+    paging_batch_commit();
 
     e1000_write(E1000_RDBAL, (uint32_t)(uint64_t)get_phys_addr((uint32_t)rx_ring));
     e1000_write(E1000_RDBAH, (uint32_t)((uint64_t)get_phys_addr((uint32_t)rx_ring) >> 32));
@@ -76,13 +79,19 @@ bool e1000_init(uint8_t bus, uint8_t dev, uint8_t func) {
 
     // TX Ring Setup
     tx_ring = alloc_aligned(sizeof(struct e1000_tx_desc) * TX_DESC_COUNT, 16);
+    paging_batch_begin(PAGE_OWNER_NIC);
     for (int i = 0; i < TX_DESC_COUNT; ++i) {
-        void* phys_addr = pmm_alloc_block();
-        tx_buffers[i] = kmalloc(4096); // Allocate virtual space
-        map_page((uint32_t)phys_addr, (uint32_t)tx_buffers[i], PTE_PRESENT | PTE_RW);
+        tx_buffers[i] = alloc_aligned(4096, 4096);
+        if (!tx_buffers[i]) {
+            paging_batch_commit();
+            return false;
+        }
+        uint32_t phys_addr = get_phys_addr((uint32_t)tx_buffers[i]);
+        pmm_set_owner((void*)phys_addr, 1, PAGE_OWNER_NIC);
         tx_ring[i].addr = (uint64_t)phys_addr;
         tx_ring[i].cmd = 0;
     }
+    paging_batch_commit();
 
     e1000_write(E1000_TDBAL, (uint32_t)(uint64_t)get_phys_addr((uint32_t)tx_ring));
     e1000_write(E1000_TDBAH, (uint32_t)((uint64_t)get_phys_addr((uint32_t)tx_ring) >> 32));
@@ -91,7 +100,7 @@ bool e1000_init(uint8_t bus, uint8_t dev, uint8_t func) {
     e1000_write(E1000_TDT, 0);
     uint32_t tctl = TCTL_EN | TCTL_PSP;
     e1000_write(E1000_TCTL, tctl);
-    print("TX ring enabled.\n", 0x07);
+    klog("E1000", "TX ring enabled.");
 
     return true;
 }
\ No newline at end of file
@@ -3,6 +3,8 @@
 #include "../include/types.h"
 #include "../include/memcore.h"
 #include "../include/e1000.h"
+#include "../include/klog.h"
+#include "../include/ata.h"
 
 
 uint32_t pci_config_read(uint8_t bus, uint8_t device, uint8_t func, uint8_t offset) {
@@ -16,6 +18,17 @@ uint32_t pci_config_read(uint8_t bus, uint8_t device, uint8_t func, uint8_t offs
     return inl(0xCFC);
 }
 
+void pci_config_write(uint8_t bus, uint8_t device, uint8_t func, uint8_t offset, uint32_t value) {
+    uint32_t address = (1U << 31)
+                     | ((uint32_t)bus << 16)
+                     | ((uint32_t)device << 11)
+                     | ((uint32_t)func << 8)
+                     | (offset & 0xFC);
+
+    outl(0xCF8, address);
+    outl(0xCFC, value);
+}
+
 void pci_scan_all() {
     for (uint16_t bus = 0; bus < 256; ++bus) {
         for (uint8_t dev = 0; dev < 32; ++dev) {
@@ -31,15 +44,14 @@ void pci_scan_all() {
 
                 
                 if (class_id == 0x02 && subclass == 0x00) {
-                    print("PCI Ethernet @ Bus ", 0x07);
-                    print_int(bus, 0x07);
-                    print(", Device ", 0x07);
-                    print_int(dev, 0x07);
-                    print(", Func ", 0x07);
-                    print_int(func, 0x07);
-                    print("\n", 0x07);
+                    klog("PCI", "Ethernet @ Bus %d, Device %d, Func %d", bus, dev, func);
                     e1000_init(bus, dev, func);
                 }
+
+                if (class_id == 0x01 && subclass == 0x01) {
+                    klog("PCI", "IDE controller @ Bus %d, Device %d, Func %d", bus, dev, func);
+                    ata_dma_init(bus, dev, func);
+                }
             }
         }
     }
@@ -59,7 +71,7 @@ void pci_list_devices() {
                 uint8_t class_id = (class_code >> 24) & 0xFF;
                 uint8_t subclass = (class_code >> 16) & 0xFF;
 
-                kprintf("  Bus %d, Dev %d, Func %d: Vendor %x, Class %x, Subclass %x\n",
+                kprintf("  Bus %d, Dev %d, Func %d: Vendor %04x, Class %02x, Subclass %02x\n",
                         bus, dev, func, vendor_id, class_id, subclass);
             }
         }
@@ -2,9 +2,13 @@
 #include "include/memcore.h"
 #include "include/keyboard.h"
 #include "include/pmm.h"
+#include "include/paging.h"
+#include "include/vma.h"
 #include "include/timer.h"
 #include "include/bdfs.h"
+#include "include/bcache.h"
 #include "include/ata.h"
+#include "include/blockdev.h"
 #include "include/colors.h"
 #include "include/cable.h"
 #include "include/exec.h"
@@ -12,6 +16,9 @@
 #include "include/ports.h"
 #include "include/cpu.h"
 #include "include/pci.h"
+#include "include/heap.h"
+#include "include/klog.h"
+#include "include/sched.h"
 
 #define PROMPT "BD> "
 #define MAX_COMMAND_LENGTH 256
@@ -24,8 +31,14 @@ void help_command() {
     print("Available commands:\n", COLOR_SYSTEM);
     print("  help     - Display this help message\n", COLOR_SYSTEM);
     print("  clear    - Clear the screen\n", COLOR_SYSTEM);
-    print("  meminfo  - Show PMM statistics\n", COLOR_SYSTEM);
+    print("  meminfo  - Show PMM statistics (-v: frames by owner)\n", COLOR_SYSTEM);
     print("  time     - Show system uptime\n", COLOR_SYSTEM);
+    print("  ps       - List kernel threads\n", COLOR_SYSTEM);
+    print("  iostat   - Show disk request counters\n", COLOR_SYSTEM);
+    print("  lsblk    - List block devices\n", COLOR_SYSTEM);
+    print("  sync     - Write cached filesystem changes to disk\n", COLOR_SYSTEM);
+    print("  defrag   - Make files contiguous and compact free space\n", COLOR_SYSTEM);
+    print("  format   - Erase a disk and create BDFS on it (format <device>)\n", COLOR_SYSTEM);
     print("  halt     - Halt the system (requires QEMU to be closed manually)\n", COLOR_SYSTEM);
     print("  reboot   - Reboot the system\n", COLOR_SYSTEM);
     print("  shutdown - Shutdown the system\n", COLOR_SYSTEM);
@@ -44,6 +57,7 @@ void help_command() {
     print("  pulse    - Show CPU and memory usage\n", COLOR_SYSTEM);
     print("  chrome   - List connected PCI devices\n", COLOR_SYSTEM);
     print("  applist  - List available applications\n", COLOR_SYSTEM);
+    print("  dmesg    - Show the kernel log\n", COLOR_SYSTEM);
 }
 
 void applist_command() {
@@ -60,8 +74,13 @@ void sysinfo_command() {
     kprintf("[sysinfo] Kernel Size: %d KB\n", kernel_size / 1024);
     kprintf("[sysinfo] Total RAM: %d MB\n", pmm_get_total_memory() / 1024 / 1024);
     kprintf("[sysinfo] Free RAM: %d MB\n", pmm_get_free_memory() / 1024 / 1024);
-    // kprintf("[sysinfo] Heap Usage: %d KB / %d KB\n", heap_get_usage() / 1024, (HEAP_END - HEAP_START) / 1024);
+    kprintf("[sysinfo] Heap Usage: %d KB / %d KB\n", heap_get_usage() / 1024, (HEAP_END - HEAP_START) / 1024);
     kprintf("[sysinfo] Uptime: %d seconds\n", timer_ticks / 100);
+    if (timer_get_tsc_khz()) {
+        kprintf("[sysinfo] Clock: TSC at %u MHz, one-shot PIT\n", timer_get_tsc_khz() / 1000);
+    } else {
+        print("[sysinfo] Clock: PIT at 100 Hz\n", COLOR_SYSTEM);
+    }
     print("[sysinfo] Drivers: ATA, BDFS, CPU, E1000, Keyboard, Paging, PCI, PMM, Timer\n", COLOR_SYSTEM);
     print("[sysinfo] Shell User: V\n", COLOR_SYSTEM);
 }
@@ -105,13 +124,16 @@ int atoi(const char* str) {
    }
    
    void cat_command(const char* filename) {
-       uint8_t buffer[1024]; // 1KB buffer
-       uint32_t bytes_read;
-       memset(buffer, 0, 1024);
-       if (bdfs_read_file(filename, buffer, &bytes_read) == 0) {
-           for (uint32_t i = 0; i < bytes_read; i++) {
-               print_char(buffer[i], COLOR_FILE);
+       uint8_t buffer[512]; // Streamed, so any file size works
+       int fd = bdfs_open(filename, BDFS_O_READ);
+       if (fd >= 0) {
+           int bytes_read;
+           while ((bytes_read = bdfs_read(fd, buffer, sizeof(buffer))) > 0) {
+               for (int i = 0; i < bytes_read; i++) {
+                   print_char(buffer[i], COLOR_FILE);
+               }
            }
+           bdfs_close(fd);
            kprintf("\n");
        } else {
            print("Error reading from file '", COLOR_ERROR);
@@ -121,10 +143,15 @@ int atoi(const char* str) {
    }
    
    void rm_command(const char* filename) {
-       if (bdfs_delete_file(filename) == 0) {
+       int result = bdfs_delete_file(filename);
+       if (result == 0) {
            print(" File '", COLOR_SUCCESS);
            print(filename, COLOR_SUCCESS);
            print("' deleted.\n", COLOR_SUCCESS);
+       } else if (result == -2) {
+           print("Error: Directory '", COLOR_ERROR);
+           print(filename, COLOR_ERROR);
+           print("' is not empty.\n", COLOR_ERROR);
        } else {
            print("Error deleting file '", COLOR_ERROR);
            print(filename, COLOR_ERROR);
@@ -190,7 +217,11 @@ int atoi(const char* str) {
     clear_screen(0x07);
 }
 
-void meminfo_command() {
+static const char* page_owner_names[PAGE_OWNER_COUNT] = {
+    "none", "kernel", "heap", "page tables", "NIC rings", "FS cache"
+};
+
+void meminfo_command(int verbose) {
     print("Physical Memory Manager (PMM) Info:\n", COLOR_SYSTEM);
     print("  Total memory: ", COLOR_SYSTEM);
     print_int(pmm_get_total_memory() / 1024 / 1024, COLOR_SYSTEM);
@@ -201,6 +232,48 @@ void meminfo_command() {
     print("  Free memory:  ", COLOR_SYSTEM);
     print_int(pmm_get_free_memory() / 1024 / 1024, COLOR_SYSTEM);
     print(" MB\n", COLOR_SYSTEM);
+
+    print("Buddy free lists (blocks per order):\n", COLOR_SYSTEM);
+    for (uint32_t order = 0; order <= PMM_MAX_ORDER; order++) {
+        kprintf("  order %2u (%4u KB): %u\n", order, 4u << order, pmm_get_free_list_depth(order));
+    }
+
+    const e820_entry_t* map;
+    uint32_t entries = pmm_get_memory_map(&map);
+    print("E820 Memory Map:\n", COLOR_SYSTEM);
+    for (uint32_t i = 0; i < entries; i++) {
+        kprintf("  %016llx - %016llx  %s\n", map[i].base, map[i].base + map[i].len,
+                map[i].type == 1 ? "usable" : "reserved");
+    }
+
+    if (verbose) {
+        // Frames that are used but owned by nobody are E820 holes and reserved ranges
+        uint32_t owned = 0;
+        print("Frames by owner:\n", COLOR_SYSTEM);
+        for (uint32_t owner = PAGE_OWNER_KERNEL; owner < PAGE_OWNER_COUNT; owner++) {
+            uint32_t blocks = pmm_get_owner_blocks(owner);
+            owned += blocks;
+            kprintf("  %-12s %6u frames  %6u KB\n", page_owner_names[owner], blocks, blocks * 4);
+        }
+        uint32_t unowned = pmm_get_used_memory() / 4096 - owned;
+        kprintf("  %-12s %6u frames  %6u KB\n", "unusable", unowned, unowned * 4);
+
+        print("Paging activity by owner (pages, batches, invlpg, CR3 reloads):\n", COLOR_SYSTEM);
+        for (uint32_t owner = PAGE_OWNER_KERNEL; owner < PAGE_OWNER_COUNT; owner++) {
+            const paging_stats_t* stats = paging_get_stats(owner);
+            kprintf("  %-12s %6u %6u %6u %6u\n", page_owner_names[owner], stats->pages,
+                    stats->batches, stats->invlpg, stats->full_flushes);
+        }
+
+        const vma_t* areas;
+        uint32_t area_count = vma_get_areas(&areas);
+        print("Demand-paged areas:\n", COLOR_SYSTEM);
+        for (uint32_t i = 0; i < area_count; i++) {
+            kprintf("  %-8s %08x-%08x  %u/%u KB resident, %u faults\n", areas[i].name,
+                    areas[i].start, areas[i].end, areas[i].resident * 4,
+                    (areas[i].end - areas[i].start) / 1024, areas[i].faults);
+        }
+    }
 }
 
 
@@ -228,13 +301,123 @@ void time_command() {
     print("\n", COLOR_SYSTEM);
 }
 
+static const char* thread_state_names[] = {
+    "unused", "ready", "running", "sleeping", "dead"
+};
+
+void ps_command() {
+    const thread_t* threads;
+    uint32_t count = sched_get_threads(&threads);
+    print("  ID  NAME             STATE     PRIO  TICKS\n", COLOR_SYSTEM);
+    for (uint32_t i = 0; i < count; i++) {
+        if (threads[i].state == THREAD_UNUSED) {
+            continue;
+        }
+        kprintf("  %-3u %-16s %-9s %-5u %u\n", threads[i].id, threads[i].name,
+                thread_state_names[threads[i].state], threads[i].priority, threads[i].cpu_ticks);
+    }
+}
+
+void iostat_command() {
+    static const char* positions[ATA_DRIVES] = {
+        "primary master", "primary slave", "secondary master", "secondary slave"
+    };
+    for (uint32_t i = 0; i < ATA_DRIVES; i++) {
+        const ata_drive_t* drive = ata_get_drive(i);
+        if (!drive->present) {
+            continue;
+        }
+        const ata_stats_t* stats = &drive->stats;
+        kprintf("%s (ATA %s): %s\n", drive->dev->name, positions[i], drive->model);
+        kprintf("  %u sectors (%u MB), %u sectors per block, LBA48 %s\n", drive->sectors,
+                drive->sectors / 2048, drive->multiple, drive->lba48 ? "yes" : "no");
+        kprintf("  Reads:  %u requests, %u sectors\n", stats->reads, stats->sectors_read);
+        kprintf("  Writes: %u requests, %u sectors\n", stats->writes, stats->sectors_written);
+        kprintf("  IRQs:   %u (%u spurious)\n", stats->irqs, stats->spurious_irqs);
+        kprintf("  DMA:    %s, %u requests, %u fell back to PIO\n",
+                drive->dma && ata_dma_enabled(drive->channel) ? "on" : "off",
+                stats->dma_requests, stats->pio_fallbacks);
+        kprintf("  Cache flushes: %u\n", stats->flushes);
+        kprintf("  Errors: %u\n", stats->errors);
+        kprintf("  Peak queue depth: %u\n", stats->queue_peak);
+    }
+
+    const bcache_stats_t* cache = bcache_get_stats();
+    kprintf("Buffer cache (%u sectors, BDFS on %s):\n", BCACHE_BLOCKS, bdfs_get_device_name());
+    kprintf("  Hits: %u  Misses: %u  Evictions: %u (%u dirty)\n", cache->hits, cache->misses,
+            cache->evictions, cache->dirty_evictions);
+    kprintf("  Write-back: %u requests, %u sectors, %u syncs, %u dirty now\n",
+            cache->writeback_requests, cache->writeback_sectors, cache->syncs, cache->dirty);
+}
+
+void lsblk_command() {
+    uint32_t count = blockdev_count();
+    if (count == 0) {
+        print("No block devices\n", COLOR_SYSTEM);
+        return;
+    }
+    print("  NAME  SECTORS     SIZE   MODEL\n", COLOR_SYSTEM);
+    for (uint32_t i = 0; i < count; i++) {
+        blockdev_t* dev = blockdev_get(i);
+        const char* model = "RAM disk";
+        for (uint32_t j = 0; j < ATA_DRIVES; j++) {
+            if (ata_get_drive(j)->dev == dev) {
+                model = ata_get_drive(j)->model;
+            }
+        }
+        kprintf("  %-5s %-11u %4u MB %s\n", dev->name, dev->sectors, dev->sectors / 2048, model);
+    }
+}
+
 void halt_command() {
     print("Halting system...\n", COLOR_SYSTEM);
     asm volatile("hlt"); // Halt the CPU
 }
 
+void defrag_command() {
+    uint32_t free, largest, moved;
+    bdfs_get_space(&free, &largest);
+    kprintf("Before: %u KB free, largest free run %u KB\n", free / 2, largest / 2);
+    int fragmented = bdfs_defrag(&moved);
+    if (fragmented < 0) {
+        print("Error: I/O error while moving files.\n", COLOR_ERROR);
+        return;
+    }
+    bdfs_get_space(&free, &largest);
+    kprintf("After:  %u KB free, largest free run %u KB\n", free / 2, largest / 2);
+    kprintf("%u files moved, %d still fragmented\n", moved, fragmented);
+}
+
+void format_command(const char* device) {
+    if (device == 0) {
+        print("Usage: format <device>, see lsblk. Everything on it is lost.\n", COLOR_ERROR);
+        return;
+    }
+    int result = bdfs_format_device(device);
+    if (result == 0) {
+        kprintf("Created BDFS on %s.\n", device);
+    } else if (result == -1) {
+        print("Error: No such device.\n", COLOR_ERROR);
+    } else if (result == -2) {
+        print("Error: Close open files first.\n", COLOR_ERROR);
+    } else if (result == -3) {
+        print("Error: Device too small or out of memory.\n", COLOR_ERROR);
+    } else {
+        print("Error: I/O error while formatting.\n", COLOR_ERROR);
+    }
+}
+
+void sync_command() {
+    if (bdfs_sync() == 0) {
+        print("Filesystem synced.\n", COLOR_SUCCESS);
+    } else {
+        print("Error syncing the filesystem.\n", COLOR_ERROR);
+    }
+}
+
 void reboot_command() {
     print("Rebooting system...\n", COLOR_SYSTEM);
+    bdfs_sync();
     // Using the keyboard controller to reset the system
     uint8_t good = 0x02;
     while (good & 0x02)
@@ -244,9 +427,15 @@ void reboot_command() {
 
 void shutdown_command() {
     print("Shutting down system...\n", COLOR_SYSTEM);
+    bdfs_sync();
     outw(0x604, 0x2000); // QEMU specific shutdown
 }
 
+static const char* irq_names[16] = {
+    "timer", "keyboard", "cascade", "com2", "com1", "lpt2", "floppy", "lpt1",
+    "rtc", "pci", "pci", "pci", "mouse", "fpu", "ata0", "ata1"
+};
+
 void pulse_command() {
     uint32_t free_mem = pmm_get_free_memory() / 1024 / 1024;
     uint32_t total_mem = pmm_get_total_memory() / 1024 / 1024;
@@ -280,6 +469,32 @@ void pulse_command() {
         }
     }
     kprintf("] %d%% (%d/%d MB)\n", mem_usage, total_mem - free_mem, total_mem);
+
+    // Where the time went over the last minute
+    int irq_total = 0;
+    for (int irq = 0; irq < 16; irq++) {
+        irq_total += cpu_get_average(CPU_CTX_IRQ(irq), CPU_HISTORY);
+    }
+    kprintf("  Last %us: %d%% kernel, %d%% IRQ, %d%% idle\n", CPU_HISTORY,
+            cpu_get_average(CPU_CTX_KERNEL, CPU_HISTORY), irq_total,
+            cpu_get_average(CPU_CTX_IDLE, CPU_HISTORY));
+    for (int irq = 0; irq < 16; irq++) {
+        int percent = cpu_get_average(CPU_CTX_IRQ(irq), CPU_HISTORY);
+        if (percent > 0) {
+            kprintf("    IRQ %2d %-10s %d%%\n", irq, irq_names[irq], percent);
+        }
+    }
+
+    // One column per second, oldest on the left
+    static const char levels[] = " .:-=+*#%@";
+    uint8_t busy[CPU_HISTORY];
+    uint32_t samples = cpu_get_history(busy, CPU_HISTORY);
+    print("  Load: [", COLOR_SYSTEM);
+    for (uint32_t i = 0; i < samples; i++) {
+        char level[2] = { levels[busy[i] >= 100 ? 9 : busy[i] / 10], 0 };
+        print(level, COLOR_SUCCESS);
+    }
+    print("]\n", COLOR_SYSTEM);
 }
 
 void echo_command(const char* text) {
@@ -301,9 +516,22 @@ void process_command(const char* command) {
     } else if (strcmp(token, "clear") == 0) {
         clear_command();
     } else if (strcmp(token, "meminfo") == 0) {
-        meminfo_command();
+        token = strtok(NULL, " ");
+        meminfo_command(token && strcmp(token, "-v") == 0);
     } else if (strcmp(token, "time") == 0) {
         time_command();
+    } else if (strcmp(token, "ps") == 0) {
+        ps_command();
+    } else if (strcmp(token, "iostat") == 0) {
+        iostat_command();
+    } else if (strcmp(token, "lsblk") == 0) {
+        lsblk_command();
+    } else if (strcmp(token, "sync") == 0) {
+        sync_command();
+    } else if (strcmp(token, "defrag") == 0) {
+        defrag_command();
+    } else if (strcmp(token, "format") == 0) {
+        format_command(strtok(NULL, " "));
     } else if (strcmp(token, "halt") == 0) {
         halt_command();
     } else if (strcmp(token, "reboot") == 0) {
@@ -389,6 +617,8 @@ void process_command(const char* command) {
         pci_list_devices();
     } else if (strcmp(token, "applist") == 0) {
         applist_command();
+    } else if (strcmp(token, "dmesg") == 0) {
+        klog_dump();
     } else if (strlen(command) > 0) {
        if (ends_with(command, ".bdx")) {
            if (execute_bdx(command) != 0) {
@@ -417,7 +647,14 @@ void start_shell() {
     while (1) {
         char c = keyboard_get_char();
         if (c == '\0') {
-            cpu_idle();
+            klog_drain();
+            // Check again with IRQs off so a keypress can't slip in between
+            // the test and the wait
+            asm volatile("cli");
+            if (!keyboard_has_char()) {
+                cpu_idle();
+            }
+            asm volatile("sti");
             continue;
         }
 
@@ -429,6 +666,7 @@ void start_shell() {
             command_buffer[command_len] = '\0'; // Null-terminate the command
             print("\n", COLOR_INPUT);
             process_command(command_buffer);
+            klog_drain(); // Show what the command logged before the next prompt
             command_len = 0;
             memset(command_buffer, 0, MAX_COMMAND_LENGTH); // Clear buffer
             print_prompt();